@@ -12,6 +12,40 @@
 #define FFS_MAGIC 0xef53
 #define FFS_FILESYSTEM_STATE 1
 #define FFS_ERROR_HANDLER 1
+#define FFS_ROOT_INODE 2
+#define FFS_DIRECT_BLOCKS 12
+#define FFS_ADDR_PER_BLOCK (FFS_BLOCKSIZE / sizeof(uint32_t))
+// blocks addressable by direct pointers and the three indirect trees
+#define FFS_MAX_FILE_BLOCKS (FFS_DIRECT_BLOCKS + FFS_ADDR_PER_BLOCK + FFS_ADDR_PER_BLOCK * FFS_ADDR_PER_BLOCK + \
+                             FFS_ADDR_PER_BLOCK * FFS_ADDR_PER_BLOCK * FFS_ADDR_PER_BLOCK)
+
+// features that change on-disk format, a reader must understand all of them
+#define FFS_FEATURE_INCOMPAT_PACKED_DIRS 0x0001
+#define FFS_FEATURE_INCOMPAT_INLINE_DATA 0x0002
+#define FFS_FEATURE_INCOMPAT_COMPRESSION 0x0004
+// zero block pointers of regular files, direct or indirect, are holes read as zeros
+#define FFS_FEATURE_INCOMPAT_SPARSE 0x0008
+#define FFS_FEATURE_INCOMPAT_SUPPORTED (FFS_FEATURE_INCOMPAT_PACKED_DIRS | FFS_FEATURE_INCOMPAT_INLINE_DATA | \
+                                        FFS_FEATURE_INCOMPAT_COMPRESSION | FFS_FEATURE_INCOMPAT_SPARSE)
+
+// features that old readers can ignore, but old writers must not touch
+#define FFS_FEATURE_RO_COMPAT_METADATA_CSUM 0x0001
+// regular files of 2 GiB and more keep upper half of their size in i_size_high
+#define FFS_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define FFS_FEATURE_RO_COMPAT_SUPPORTED (FFS_FEATURE_RO_COMPAT_METADATA_CSUM | FFS_FEATURE_RO_COMPAT_LARGE_FILE)
+
+// inode flags
+#define FFS_INODE_COMPRESSED 0x00000004
+#define FFS_INODE_INLINE_DATA 0x10000000
+
+// compressed files are split into clusters of blocks, a cluster stored in fewer blocks than it covers
+// is compressed and starts with its compressed length, the rest of its block map entries are zero
+#define FFS_CLUSTER_BLOCKS 16
+#define FFS_CLUSTER_SIZE (FFS_CLUSTER_BLOCKS * FFS_BLOCKSIZE)
+#define FFS_CLUSTER_HEADER_LENGTH 4
+
+// block map and the padding after it hold contents of tiny files and symlinks
+#define FFS_INLINE_DATA_MAX 80
 
 typedef struct ffs_superblock {
     uint32_t sb_inodes_count;
@@ -31,11 +65,14 @@ typedef struct ffs_superblock {
     uint16_t sb_state;
     uint16_t sb_errors;
     uint16_t sb_minor_rev_level;
-    uint32_t sb_pad4;
+    uint32_t sb_feature_ro_compat;
     uint32_t sb_checkinterval;
-    uint32_t sb_pad5;
+    uint32_t sb_feature_incompat;
     uint32_t sb_rev_level;
-    uint64_t pad6[118];
+    uint64_t pad6[117];
+    uint32_t sb_pad7;
+    // crc32c of everything before it
+    uint32_t sb_checksum;
 } ffs_sb_t;
 
 typedef struct ffs_block_group_descriptor {
@@ -45,13 +82,17 @@ typedef struct ffs_block_group_descriptor {
     uint16_t bgd_free_blocks_count;
     uint16_t bgd_free_inodes_count;
     uint16_t bgd_used_dirs_count;
-    uint16_t bgd_pad[7];
+    // low 16 bits of crc32c of bitmaps and of the descriptor itself
+    uint16_t bgd_block_bitmap_csum;
+    uint16_t bgd_inode_bitmap_csum;
+    uint16_t bgd_pad[4];
+    uint16_t bgd_checksum;
 } ffs_bgd_t;
 
 typedef struct ffs_inode {
     uint16_t i_mode;
     uint16_t i_uid;
-    int32_t i_size;
+    uint32_t i_size;
     uint32_t i_atime;
     uint32_t i_ctime;
     uint32_t i_mtime;
@@ -59,12 +100,18 @@ typedef struct ffs_inode {
     uint16_t i_gid;
     uint16_t i_links_count;
     uint32_t i_blocks;
-    uint64_t i_pad1;
-    uint32_t i_block[15];
-    uint32_t i_pad2[5];
+    uint32_t i_size_high;
+    uint32_t i_checksum;
+    union {
+        struct {
+            uint32_t i_block[15];
+            uint32_t i_pad2[5];
+        };
+        uint8_t i_data[FFS_INLINE_DATA_MAX];
+    };
     uint16_t i_uid_high;
     uint16_t i_gid_high;
-    uint32_t i_pad3;
+    uint32_t i_flags;
 } ffs_inode_t;
 
 typedef struct ffs_block {
@@ -79,8 +126,12 @@ typedef struct ffs_block_group {
 } ffs_bg_t;
 
 #define FFS_DIR_ENTRY_RECORD_LENGTH 256
+#define FFS_DIR_ENTRY_HEADER_LENGTH 8
 #define FFS_FILENAME_MAX_LENGTH 247
 
+// packed entries take header plus name rounded up to 4 bytes
+#define FFS_DIR_PACKED_RECORD_LENGTH(name_len) (FFS_DIR_ENTRY_HEADER_LENGTH + (((name_len) + 3) & ~3))
+
 typedef struct ffs_dir_entry {
     uint32_t de_inode;
     uint16_t de_rec_len;
@@ -88,4 +139,12 @@ typedef struct ffs_dir_entry {
     uint8_t de_name[248];
 } ffs_de_t;
 
+// checksummed directory blocks end with a record that looks unused to readers walking the block
+typedef struct ffs_dir_tail {
+    uint32_t dt_inode;
+    uint16_t dt_rec_len;
+    uint16_t dt_name_len;
+    uint32_t dt_checksum;
+} ffs_dt_t;
+
 #endif //FFS_H
@@ -4,28 +4,170 @@
 #define FUSE_USE_VERSION 26
 
 #include <ffs.h>
+#include <libffs.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
 struct ffs_init_data {
     char *source;
+    ffs_fs_t *fs;
+    // warm-up threads started at mount, 0 disables warm-up
+    uint64_t warmup_threads;
+    // file listing hot inodes, read at mount and written at unmount
+    char *hot_list;
 };
 
 #define FFS_DATA ((struct ffs_init_data *) fuse_get_context()->private_data)
 
+// set associative cache of superblock, descriptor, inode table and directory blocks
+#define FFS_META_CACHE_SETS 256
+#define FFS_META_CACHE_WAYS 4
+
+// decompressed clusters kept by an open image
+#define FFS_CLUSTER_CACHE_SIZE 64
+
+// mount-time warm-up reads metadata in runs of up to this many blocks, hot list is split in chunks of inodes
+#define FFS_WARMUP_RUN 64
+#define FFS_WARMUP_HOT_CHUNK 256
+
+// kinds of cached metadata blocks, they differ in how their checksums are verified
+enum ffs_meta_kind {
+    FFS_META_DESCRIPTORS,
+    FFS_META_INODES,
+    FFS_META_DIRECTORY,
+    FFS_META_INDIRECT
+};
+
+// ways a block enters the metadata cache, prefetches never evict blocks that were read and scans of whole
+// groups also leave blocks of the hot list alone
+enum ffs_meta_load {
+    FFS_META_DEMAND,
+    FFS_META_HOT,
+    FFS_META_SCAN
+};
+
+// metadata block, items that failed verification when it was loaded are kept in a mask
+struct ffs_meta_cache_entry {
+    uint8_t valid;
+    uint8_t kind;
+    uint32_t blockno;
+    // location of the first item, first inode number for inode table blocks
+    uint64_t base;
+    // last read, 0 for prefetched blocks nobody has read yet
+    uint64_t used;
+    uint64_t bad;
+    ffs_block_t block;
+};
+
+// decompressed cluster, keyed by the first block it is stored in
+struct ffs_cluster_cache_entry {
+    uint32_t blockno;
+    uint64_t used;
+    size_t size;
+    uint8_t data[FFS_CLUSTER_SIZE];
+};
+
+// opened image, its superblock and caches shared by all threads using it
+struct ffs_fs {
+    int fd;
+    ffs_sb_t sb;
+
+    struct ffs_meta_cache_entry meta_cache[FFS_META_CACHE_SETS][FFS_META_CACHE_WAYS];
+    uint64_t meta_cache_clock;
+    uint64_t meta_cache_hits;
+    uint64_t meta_cache_misses;
+    uint64_t meta_cache_filled;
+    // writes seen by each set, a load started before one of them may hold stale data and is dropped
+    uint64_t meta_cache_writes[FFS_META_CACHE_SETS];
+    pthread_mutex_t meta_cache_lock;
+
+    struct ffs_cluster_cache_entry cluster_cache[FFS_CLUSTER_CACHE_SIZE];
+    uint64_t cluster_cache_clock;
+    uint64_t cluster_cache_hits;
+    uint64_t cluster_cache_misses;
+    pthread_mutex_t cluster_cache_lock;
+
+    // warm-up tasks are hot list chunks followed by block groups, threads take the next one in turn
+    pthread_t *warmup_threads;
+    uint64_t warmup_thread_count;
+    uint64_t *warmup_hot;
+    uint64_t warmup_hot_count;
+    uint64_t warmup_tasks;
+    uint64_t warmup_next;
+    uint64_t warmup_done;
+    uint64_t warmup_blocks;
+    uint8_t warmup_stop;
+    pthread_mutex_t warmup_lock;
+
+    // serializes changes of bitmaps, free counts, block maps and every inode rewrite, also guards free counts, incompatible
+    // features and checksum of sb, the rest of it never changes once the image is open
+    pthread_mutex_t alloc_lock;
+};
+
 ssize_t writebuff(int fd, void *buffer, size_t size);
 
+ssize_t pwritebuff(int fd, void *buffer, size_t size, off_t offset);
+
+ssize_t preadbuff(int fd, void *buffer, size_t size, off_t offset);
+
 void bitmap_set_bit(uint8_t *bitmap, uint16_t bit, uint8_t val);
 
-uint8_t read_superblock(FILE *fs, ffs_sb_t *sb);
+uint8_t bitmap_get_bit(uint8_t *bitmap, uint16_t bit);
+
+// file size, upper half is only used by large regular files
+uint64_t ffs_inode_size(ffs_inode_t *inode);
+
+void ffs_inode_set_size(ffs_inode_t *inode, uint64_t size);
+
+uint8_t read_bgd(ffs_fs_t *fs, uint64_t gbn, ffs_bgd_t *bgd);
+
+// finds block and offset of the inode in its group's inode table
+uint8_t inode_location(ffs_fs_t *fs, uint64_t inodei, uint32_t *blockno, size_t *offset);
+
+// loads count physically contiguous metadata blocks with one read, blocks already cached are kept,
+// returns number of blocks that went to free ways
+uint64_t meta_preload(ffs_fs_t *fs, uint32_t blockno, uint64_t count, uint8_t kind, uint64_t base, uint8_t load);
+
+uint8_t read_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode);
+
+// reads inode for warm-up, its table block is loaded as a prefetch and is not marked as read
+uint8_t prefetch_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode, uint8_t load);
+
+// reads directory block through metadata cache, fails if its checksum does not match
+uint8_t read_dir_block(ffs_fs_t *fs, uint32_t blockno, ffs_block_t *block);
+
+// number of indirect blocks needed to address given number of data blocks
+uint64_t ffs_meta_blocks(uint64_t blocks);
+
+// physical block number of inode's logical block, 0 if it is not mapped or cannot be read
+uint32_t ffs_bmap(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block);
+
+// same, but failures are told apart from holes, for a hole extent is set to the number of logical blocks
+// from this one that are known to be unmapped, which can cover a whole missing indirect tree
+uint8_t ffs_bmap_extent(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block, uint32_t *blockno, uint64_t *extent);
+
+// clears block pointer of a logical block, returns the block it pointed to in freed, 0 for a hole
+uint8_t ffs_unmap_block(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block, uint32_t *freed);
+
+// returns sorted blocks to their groups' bitmaps and updates free counts of groups and superblock,
+// called with alloc_lock held
+uint8_t ffs_free_blocks(ffs_fs_t *fs, uint32_t *blocknos, uint64_t count);
+
+// records incompatible feature in the superblock once it is first used, called with alloc_lock held
+uint8_t ffs_set_feature_incompat(ffs_fs_t *fs, uint32_t feature);
+
+// reads file contents, returns number of bytes read or -1 on failure
+int64_t read_inode_data(ffs_fs_t *fs, ffs_inode_t *inode, void *buf, size_t size, uint64_t offset);
 
-uint8_t read_inode(FILE *fs, uint64_t inodei, ffs_inode_t *inode);
+// directory entry starting at pos, NULL past the last entry of the block
+ffs_de_t *dir_entry_at(ffs_block_t *block, size_t pos);
 
-int64_t entry_inode_no(FILE *fs, ffs_inode_t *inode, char *entry_name);
+int64_t entry_inode_no(ffs_fs_t *fs, ffs_inode_t *inode, const char *entry_name);
 
-int64_t path_to_inode(FILE *fs, const char *path);
+int64_t path_to_inode(ffs_fs_t *fs, const char *path);
 
-uint8_t write_inode(FILE *fs, uint64_t inodei, ffs_inode_t *inode);
+uint8_t write_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode);
 
 #endif //FFS_COMMON_H
@@ -0,0 +1,39 @@
+#ifndef FFS_CSUM_H
+#define FFS_CSUM_H
+
+#include "ffs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// crc32c (Castagnoli) continuing from crc, uses the SSE4.2 crc32 instruction when the CPU has it
+uint32_t ffs_crc32c(uint32_t crc, const void *buffer, size_t size);
+
+// table driven crc32c, used when the instruction is missing
+uint32_t ffs_crc32c_portable(uint32_t crc, const void *buffer, size_t size);
+
+// whether ffs_crc32c runs on hardware
+uint8_t ffs_crc32c_accelerated(void);
+
+// checksums of metadata structures, each one is seeded with the structure's location,
+// so a block written to a wrong place does not verify either
+
+uint32_t ffs_sb_checksum(ffs_sb_t *sb);
+
+uint16_t ffs_bgd_checksum(uint64_t gbn, ffs_bgd_t *bgd);
+
+uint16_t ffs_bitmap_checksum(uint32_t blockno, uint8_t *bitmap);
+
+uint32_t ffs_inode_checksum(uint64_t inodei, ffs_inode_t *inode);
+
+// unused, all-zero inodes carry no checksum
+uint8_t ffs_inode_verify(uint64_t inodei, ffs_inode_t *inode);
+
+uint32_t ffs_dir_block_checksum(uint32_t blockno, ffs_block_t *block);
+
+// writes tail record with checksum at the end of directory block
+void ffs_dir_block_seal(uint32_t blockno, ffs_block_t *block);
+
+uint8_t ffs_dir_block_verify(uint32_t blockno, ffs_block_t *block);
+
+#endif //FFS_CSUM_H
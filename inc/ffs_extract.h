@@ -0,0 +1,46 @@
+#ifndef FFS_EXTRACT_H
+#define FFS_EXTRACT_H
+
+#include "libffs.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// bytes read from the image at once by every copying thread
+#define FFS_EXTRACT_CHUNK (4 * 1024 * 1024)
+
+typedef struct ffs_extract_node {
+    char *path;
+    uint64_t inodei;
+    struct stat st;
+    // physical block of the file's first block, files are copied in this order
+    uint32_t first;
+} ffs_extract_node_t;
+
+typedef struct ffs_extract_list {
+    ffs_extract_node_t *nodes;
+    uint64_t count;
+    uint64_t capacity;
+} ffs_extract_list_t;
+
+typedef struct ffs_extract {
+    ffs_fs_t *fs;
+    const char *destination;
+    ffs_extract_list_t dirs;
+    ffs_extract_list_t files;
+    uint64_t symlinks;
+    uint64_t bytes;
+    uint64_t next;
+    pthread_mutex_t lock;
+} ffs_extract_t;
+
+void ffs_extract_tree(ffs_extract_t *extract);
+
+void ffs_extract_files(ffs_extract_t *extract, uint64_t threads);
+
+void ffs_extract_finish(ffs_extract_t *extract);
+
+void ffs_extract_free(ffs_extract_t *extract);
+
+#endif //FFS_EXTRACT_H
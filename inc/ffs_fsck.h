@@ -0,0 +1,70 @@
+#ifndef FFS_FSCK_H
+#define FFS_FSCK_H
+
+#include "ffs.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define FFS_FSCK_OK 0
+#define FFS_FSCK_ERRORS 4
+#define FFS_FSCK_FAILURE 8
+
+// whether an inode can be reached from the root directory
+#define FFS_FSCK_UNKNOWN 0
+#define FFS_FSCK_VISITING 1
+#define FFS_FSCK_REACHED 2
+#define FFS_FSCK_UNREACHED 3
+
+// bitset shared between checking threads
+typedef struct ffs_bitset {
+    uint64_t *words;
+    uint64_t bits;
+} ffs_bitset_t;
+
+// what the directory walk found out about an inode
+typedef struct ffs_fsck_links {
+    // entries naming it, '.' and '..' included
+    uint32_t refs;
+    // directory of an entry naming it, '..' of a directory
+    uint32_t parent;
+    uint32_t dotdot;
+    // taken from the inode, zero for unused ones
+    uint16_t links_count;
+    uint8_t dir;
+    uint8_t reach;
+} ffs_fsck_links_t;
+
+typedef struct ffs_fsck {
+    int fd;
+    ffs_sb_t sb;
+    uint64_t bgn;
+    uint64_t bgdt_blocks;
+    ffs_bgd_t *bgdt;
+    // metadata checksums are present
+    uint8_t csum;
+    // blocks referenced by metadata and inodes
+    ffs_bitset_t blocks;
+    // inodes referenced by directory entries, once and more than once
+    ffs_bitset_t inodes;
+    ffs_bitset_t inodes_twice;
+    // reference counts and parents, indexed by inode number
+    ffs_fsck_links_t *links;
+    uint64_t next_group;
+    uint64_t problems;
+    uint64_t used_inodes;
+    uint64_t used_blocks;
+    pthread_mutex_t lock;
+} ffs_fsck_t;
+
+int ffs_fsck_open(ffs_fsck_t *fsck, const char *filename);
+
+void ffs_fsck_close(ffs_fsck_t *fsck);
+
+void ffs_fsck_check_superblock(ffs_fsck_t *fsck);
+
+void ffs_fsck_check_groups(ffs_fsck_t *fsck, uint64_t threads);
+
+void ffs_fsck_check_bitmaps(ffs_fsck_t *fsck, uint64_t threads);
+
+#endif //FFS_FSCK_H
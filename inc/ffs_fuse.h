@@ -4,6 +4,12 @@
 #include <fcntl.h>
 #include <fuse.h>
 
+// extended attribute of the root holding cache and warm-up statistics
+#define FFS_STATS_XATTR "user.ffs.stats"
+
+// most inodes kept in the hot list, as many as fit into the metadata cache
+#define FFS_HOT_LIST_MAX (FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS * FFS_BLOCKSIZE / sizeof(ffs_inode_t))
+
 int ffs_statfs(const char *path, struct statvfs *statv);
 
 int ffs_opendir(const char *path, struct fuse_file_info *fi);
@@ -20,6 +26,10 @@ int ffs_chown(const char *path, uid_t uid, gid_t gid);
 
 int ffs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
+int ffs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+
+int ffs_readlink(const char *path, char *buf, size_t size);
+
 int ffs_access(const char *path, int mask);
 
 int ffs_utimens(const char *path, const struct timespec tv[2]);
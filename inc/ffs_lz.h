@@ -0,0 +1,16 @@
+#ifndef FFS_LZ_H
+#define FFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// LZ77 codec producing LZ4 block format
+
+// compresses size bytes of src, returns compressed size or 0 if it does not fit into capacity
+size_t ffs_lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+// returns decompressed size or -1 if src is corrupted or does not fit into capacity
+ssize_t ffs_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+
+#endif //FFS_LZ_H
@@ -3,10 +3,57 @@
 
 #include "ffs.h"
 
-void ffs_write_superblock(int fd, uint64_t bgn, uint64_t bgdt_blocks);
+// in-memory image of filesystem metadata, written out after all data is placed
+typedef struct ffs_layout {
+    uint64_t bgn;
+    uint64_t bgdt_blocks;
+    ffs_bgd_t *bgdt;
+    uint8_t *block_bitmaps;
+    uint8_t *inode_bitmaps;
+    ffs_inode_t **inode_tables;
+    uint64_t next_inode;
+    uint64_t next_data;
+    uint64_t data_blocks;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    // holes of source files may be kept, sparse feature is only recorded once a file has one
+    uint8_t sparse;
+} ffs_layout_t;
 
-void ffs_write_bgd_table(int fd, uint64_t bgn, uint64_t bgdt_blocks);
+void ffs_init_layout(ffs_layout_t *layout, uint64_t bgn, uint64_t bgdt_blocks);
 
-void ffs_write_block_groups(int fd, uint64_t bgn, uint64_t bgdt_blocks);
+void ffs_free_layout(ffs_layout_t *layout);
+
+ffs_inode_t *ffs_layout_inode(ffs_layout_t *layout, uint64_t inodei);
+
+uint64_t ffs_alloc_inode(ffs_layout_t *layout, uint8_t dir);
+
+uint64_t ffs_alloc_blocks(ffs_layout_t *layout, uint64_t count);
+
+uint32_t ffs_data_block(ffs_layout_t *layout, uint64_t ordinal);
+
+// number of indirect blocks a file needs, trees addressing only unstored blocks are left out of sparse layouts
+uint64_t ffs_map_meta_blocks(ffs_layout_t *layout, uint64_t blocks, uint8_t *clusters);
+
+void ffs_map_blocks(ffs_layout_t *layout, uint64_t first, uint64_t blocks, uint32_t *i_block, uint8_t *meta,
+                    uint8_t *clusters);
+
+// offset where directory entries of a block have to end
+uint16_t ffs_dir_block_end(ffs_layout_t *layout);
+
+// adds checksum tails to directory blocks about to be written at given ordinals
+void ffs_seal_dir_blocks(ffs_layout_t *layout, uint64_t first, void *buffer, uint64_t count);
+
+uint16_t ffs_dir_rec_len(ffs_layout_t *layout, uint16_t name_len);
+
+void ffs_write_ordinals(int fd, ffs_layout_t *layout, uint64_t first, void *buffer, uint64_t count);
+
+void ffs_write_root_directory(int fd, ffs_layout_t *layout);
+
+void ffs_write_superblock(int fd, ffs_layout_t *layout);
+
+void ffs_write_bgd_table(int fd, ffs_layout_t *layout);
+
+void ffs_write_block_groups(int fd, ffs_layout_t *layout);
 
 #endif //FFS_MKFS_H
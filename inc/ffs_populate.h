@@ -0,0 +1,44 @@
+#ifndef FFS_POPULATE_H
+#define FFS_POPULATE_H
+
+#include "ffs_mkfs.h"
+
+#include <sys/stat.h>
+
+#define FFS_COPY_CHUNK_BLOCKS 512
+
+typedef struct ffs_node {
+    char *path;
+    char *name;
+    struct stat st;
+    uint64_t parent;
+    uint64_t first_child;
+    uint64_t children;
+    uint64_t subdirs;
+    uint64_t inodei;
+    uint64_t first;
+    uint64_t blocks;
+    // indirect blocks, only trees over stored blocks take any
+    uint64_t meta;
+    // data blocks actually stored and blocks taken by every cluster of a compressed or sparse file
+    uint64_t stored;
+    uint8_t *clusters;
+    uint8_t compressed;
+    // packed clusters of a compressed file wait in a spill file between measuring and copying
+    int spill;
+    uint64_t spill_offset;
+} ffs_node_t;
+
+typedef struct ffs_tree {
+    ffs_node_t *nodes;
+    uint64_t count;
+    uint64_t capacity;
+} ffs_tree_t;
+
+void ffs_scan_tree(ffs_tree_t *tree, const char *source);
+
+void ffs_free_tree(ffs_tree_t *tree);
+
+void ffs_populate(int fd, ffs_layout_t *layout, const char *source, uint64_t threads);
+
+#endif //FFS_POPULATE_H
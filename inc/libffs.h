@@ -0,0 +1,103 @@
+#ifndef LIBFFS_H
+#define LIBFFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// glibc declares these only with _GNU_SOURCE, values are the same on every Linux libc
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
+
+// libffs reads ffs images directly, without mounting them.
+//
+// Every call takes a handle returned by ffs_fs_open, one handle may be used by any number of threads at once.
+// Files are addressed by inode number, ffs_fs_lookup turns absolute paths into them. Calls return EXIT_SUCCESS,
+// or EXIT_FAILURE with errno set, reads return number of bytes or -1 with errno set. Metadata checksums are
+// verified once when a block is first loaded, mismatches are reported as EBADMSG.
+
+typedef struct ffs_fs ffs_fs_t;
+
+// cache counters and progress of a running warm-up
+typedef struct ffs_fs_stats {
+    uint64_t meta_hits;
+    uint64_t meta_misses;
+    uint64_t cluster_hits;
+    uint64_t cluster_misses;
+    uint8_t warmup_running;
+    uint64_t warmup_tasks;
+    uint64_t warmup_tasks_done;
+    uint64_t warmup_blocks;
+} ffs_fs_stats_t;
+
+// called for every directory entry, cookie resumes the listing after the entry, non-zero return stops it
+typedef int (*ffs_fs_dirent_t)(void *arg, const char *name, uint64_t inodei, uint64_t cookie);
+
+// called for every node of a walk, path is relative to the walk root, non-zero return stops the walk
+typedef int (*ffs_fs_visit_t)(void *arg, const char *path, uint64_t inodei, const struct stat *st);
+
+// opens image with O_RDONLY or O_RDWR and checks its superblock, NULL on failure
+ffs_fs_t *ffs_fs_open(const char *image, int flags);
+
+// same for already opened image, fd belongs to the handle afterwards
+ffs_fs_t *ffs_fs_open_fd(int fd, int flags);
+
+void ffs_fs_close(ffs_fs_t *fs);
+
+int ffs_fs_statfs(ffs_fs_t *fs, struct statvfs *st);
+
+// resolves absolute path
+int ffs_fs_lookup(ffs_fs_t *fs, const char *path, uint64_t *inodei);
+
+// finds a single name in directory
+int ffs_fs_lookup_at(ffs_fs_t *fs, uint64_t dir, const char *name, uint64_t *inodei);
+
+int ffs_fs_stat(ffs_fs_t *fs, uint64_t inodei, struct stat *st);
+
+int64_t ffs_fs_read(ffs_fs_t *fs, uint64_t inodei, void *buf, size_t size, uint64_t offset);
+
+// SEEK_DATA or SEEK_HOLE from offset, returns the found offset or -1 with ENXIO past the end of data,
+// end of file counts as a hole, compressed files are looked at by whole clusters
+int64_t ffs_fs_lseek(ffs_fs_t *fs, uint64_t inodei, uint64_t offset, int whence);
+
+// deallocates blocks fully inside the range and zeroes the partial ones at its edges, file size is kept,
+// inline and compressed files are refused with EOPNOTSUPP
+int ffs_fs_punch_hole(ffs_fs_t *fs, uint64_t inodei, uint64_t offset, uint64_t length);
+
+// reads symlink target, truncated to size - 1 bytes and null-terminated, size 0 fails with EINVAL
+int ffs_fs_readlink(ffs_fs_t *fs, uint64_t inodei, char *buf, size_t size);
+
+// lists directory entries after cookie, 0 starts from the beginning, stopping early is not an error
+int ffs_fs_readdir(ffs_fs_t *fs, uint64_t dir, uint64_t cookie, ffs_fs_dirent_t fill, void *arg);
+
+// walks the tree under directory depth first, a directory is visited before its contents, '.' and '..' are not
+int ffs_fs_iterate(ffs_fs_t *fs, uint64_t dir, ffs_fs_visit_t visit, void *arg);
+
+// physical block holding logical block of the inode, 0 if it has none, lets callers order reads by disk position
+uint32_t ffs_fs_bmap(ffs_fs_t *fs, uint64_t inodei, uint64_t block);
+
+// permission bits only, file type is kept
+int ffs_fs_chmod(ffs_fs_t *fs, uint64_t inodei, mode_t mode);
+
+int ffs_fs_chown(ffs_fs_t *fs, uint64_t inodei, uid_t uid, gid_t gid);
+
+int ffs_fs_stats(ffs_fs_t *fs, ffs_fs_stats_t *stats);
+
+// starts background threads filling the metadata cache, inodes of the hot list first and then every block group
+// in order, the handle serves calls meanwhile, the list is copied
+int ffs_fs_warmup_start(ffs_fs_t *fs, uint64_t threads, const uint64_t *hot, uint64_t count);
+
+// stops warm-up and waits for its threads, also done by ffs_fs_close
+void ffs_fs_warmup_stop(ffs_fs_t *fs);
+
+// fills up to max in-use inodes whose table blocks are cached, most recently used first, returns their number
+uint64_t ffs_fs_hot_inodes(ffs_fs_t *fs, uint64_t *inodes, uint64_t max);
+
+#endif //LIBFFS_H
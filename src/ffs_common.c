@@ -1,10 +1,13 @@
 #include "ffs_common.h"
 
 #include <ffs.h>
-#include <fuse.h>
+#include <ffs_csum.h>
+#include <ffs_lz.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 ssize_t writebuff(int fd, void *buffer, size_t size) {
@@ -23,6 +26,43 @@ ssize_t writebuff(int fd, void *buffer, size_t size) {
     return written_bytes;
 }
 
+ssize_t pwritebuff(int fd, void *buffer, size_t size, off_t offset) {
+    size_t written_bytes = 0;
+    errno = 0;
+    while (written_bytes < size) {
+        ssize_t just_written = pwrite(fd, (uint8_t *) buffer + written_bytes, size - written_bytes,
+                                      offset + written_bytes);
+        if (just_written == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        written_bytes += just_written;
+    }
+    return written_bytes;
+}
+
+ssize_t preadbuff(int fd, void *buffer, size_t size, off_t offset) {
+    size_t read_bytes = 0;
+    errno = 0;
+    while (read_bytes < size) {
+        ssize_t just_read = pread(fd, (uint8_t *) buffer + read_bytes, size - read_bytes, offset + read_bytes);
+        if (just_read == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        // end of file
+        if (just_read == 0) {
+            break;
+        }
+        read_bytes += just_read;
+    }
+    return read_bytes;
+}
+
 void bitmap_set_bit(uint8_t *bitmap, uint16_t bit, uint8_t val) {
     if (val == 0) {
         bitmap[bit / 8] &= ~(1 << (bit % 8));
@@ -31,131 +71,731 @@ void bitmap_set_bit(uint8_t *bitmap, uint16_t bit, uint8_t val) {
     }
 }
 
-uint8_t read_superblock(FILE *fs, ffs_sb_t *sb) {
-    // skip MBR
-    if (fseek(fs, 1024, SEEK_SET) == -1) {
-        return EXIT_FAILURE;
+uint8_t bitmap_get_bit(uint8_t *bitmap, uint16_t bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// size of a separately verified item in the block of each kind
+static const size_t meta_item_size[] = {
+        [FFS_META_DESCRIPTORS] = sizeof(ffs_bgd_t),
+        [FFS_META_INODES] = sizeof(ffs_inode_t),
+        [FFS_META_DIRECTORY] = sizeof(ffs_block_t),
+        [FFS_META_INDIRECT] = sizeof(ffs_block_t)
+};
+
+// returns mask of items that do not match their checksums, base is the location of the first item
+static uint64_t meta_verify(ffs_fs_t *fs, uint8_t kind, uint64_t base, uint32_t blockno, ffs_block_t *block) {
+    if (!(fs->sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+        return 0;
+    }
+
+    uint64_t bad = 0;
+    switch (kind) {
+        case FFS_META_DESCRIPTORS:
+            // last block of the table is not full
+            for (uint64_t i = 0; i < sizeof(ffs_block_t) / sizeof(ffs_bgd_t) &&
+                                 base + i < fs->sb.sb_blocks_count / fs->sb.sb_blocks_per_group; ++i) {
+                ffs_bgd_t *bgd = (ffs_bgd_t *) block->b_data + i;
+                if (bgd->bgd_checksum != ffs_bgd_checksum(base + i, bgd)) {
+                    bad |= (uint64_t) 1 << i;
+                }
+            }
+            break;
+        case FFS_META_INODES:
+            for (uint64_t i = 0; i < sizeof(ffs_block_t) / sizeof(ffs_inode_t); ++i) {
+                if (ffs_inode_verify(base + i, (ffs_inode_t *) block->b_data + i) == EXIT_FAILURE) {
+                    bad |= (uint64_t) 1 << i;
+                }
+            }
+            break;
+        case FFS_META_DIRECTORY:
+            bad = ffs_dir_block_verify(blockno, block) == EXIT_FAILURE;
+            break;
+    }
+
+    if (bad != 0) {
+        fprintf(stderr, "ffs: checksum mismatch in block %u\n", blockno);
     }
+    return bad;
+}
+
+// puts block into least recently used way of its set, called with the cache locked. prefetched blocks stay
+// unused until they are read, blocks of the hot list may only replace other unread prefetches and scans take
+// free ways only, returns 1 if a free way was filled
+static uint8_t meta_insert(ffs_fs_t *fs, uint32_t blockno, uint8_t kind, uint64_t base, uint64_t bad,
+                           ffs_block_t *block, uint8_t load) {
+    struct ffs_meta_cache_entry *set = fs->meta_cache[blockno % FFS_META_CACHE_SETS];
 
-    // read superblock
-    if (fread(sb, sizeof(ffs_sb_t), 1, fs) != 1) {
+    size_t victim = 0;
+    for (size_t i = 0; i < FFS_META_CACHE_WAYS; ++i) {
+        if (set[i].valid && set[i].blockno == blockno && load != FFS_META_DEMAND) {
+            return 0;
+        }
+        if (!set[i].valid || set[i].blockno == blockno) {
+            victim = i;
+            break;
+        }
+        if (set[i].used < set[victim].used) {
+            victim = i;
+        }
+    }
+    uint8_t filled = !set[victim].valid;
+    if ((load == FFS_META_HOT && !filled && set[victim].used != 0) || (load == FFS_META_SCAN && !filled)) {
+        return 0;
+    }
+    set[victim].valid = 1;
+    set[victim].kind = kind;
+    set[victim].blockno = blockno;
+    set[victim].base = base;
+    set[victim].used = load == FFS_META_DEMAND ? ++fs->meta_cache_clock : 0;
+    set[victim].bad = bad;
+    memcpy(&set[victim].block, block, sizeof(ffs_block_t));
+    fs->meta_cache_filled += filled;
+    return filled;
+}
+
+// reads size bytes at offset of a metadata block through the cache, checksums are verified once when
+// a block is loaded and items that failed are remembered instead of the block being read again. reads made
+// for a prefetch neither count nor mark the block as read, and load a missing block as that prefetch
+static uint8_t meta_read(ffs_fs_t *fs, uint32_t blockno, uint8_t kind, uint64_t base, size_t offset, void *buf,
+                         size_t size, uint8_t load) {
+    if (blockno == 0 || blockno >= fs->sb.sb_blocks_count) {
+        errno = EIO;
         return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    struct ffs_meta_cache_entry *set = fs->meta_cache[blockno % FFS_META_CACHE_SETS];
+    uint64_t *writes = &fs->meta_cache_writes[blockno % FFS_META_CACHE_SETS];
+    uint64_t item = (uint64_t) 1 << (offset / meta_item_size[kind]);
+
+    for (;;) {
+        pthread_mutex_lock(&fs->meta_cache_lock);
+        for (size_t i = 0; i < FFS_META_CACHE_WAYS; ++i) {
+            if (set[i].valid && set[i].blockno == blockno) {
+                if (load == FFS_META_DEMAND) {
+                    set[i].used = ++fs->meta_cache_clock;
+                    fs->meta_cache_hits++;
+                }
+                uint8_t bad = (set[i].bad & item) != 0;
+                memcpy(buf, set[i].block.b_data + offset, size);
+                pthread_mutex_unlock(&fs->meta_cache_lock);
+                if (bad) {
+                    errno = EBADMSG;
+                    return EXIT_FAILURE;
+                }
+                return EXIT_SUCCESS;
+            }
+        }
+        uint64_t seen = *writes;
+        pthread_mutex_unlock(&fs->meta_cache_lock);
+
+        // load and verify without holding the lock, a concurrent load of the same block is harmless
+        ffs_block_t block;
+        if (preadbuff(fs->fd, &block, sizeof(block), (off_t) blockno * sizeof(ffs_block_t)) != sizeof(block)) {
+            errno = errno == 0 ? EIO : errno;
+            return EXIT_FAILURE;
+        }
+        uint64_t bad = meta_verify(fs, kind, base, blockno, &block);
+
+        // a write to the set since the lookup may have missed this copy, so it is read again
+        pthread_mutex_lock(&fs->meta_cache_lock);
+        if (*writes != seen) {
+            pthread_mutex_unlock(&fs->meta_cache_lock);
+            continue;
+        }
+        fs->meta_cache_misses += load == FFS_META_DEMAND;
+        meta_insert(fs, blockno, kind, base, bad, &block, load);
+        pthread_mutex_unlock(&fs->meta_cache_lock);
+
+        memcpy(buf, block.b_data + offset, size);
+        if ((bad & item) != 0) {
+            errno = EBADMSG;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+}
+
+// keeps cached copy of a metadata block in line with what was written to disk
+static void meta_update(ffs_fs_t *fs, uint32_t blockno, size_t offset, void *buf, size_t size) {
+    struct ffs_meta_cache_entry *set = fs->meta_cache[blockno % FFS_META_CACHE_SETS];
+
+    pthread_mutex_lock(&fs->meta_cache_lock);
+    fs->meta_cache_writes[blockno % FFS_META_CACHE_SETS]++;
+    for (size_t i = 0; i < FFS_META_CACHE_WAYS; ++i) {
+        if (set[i].valid && set[i].blockno == blockno) {
+            memcpy(set[i].block.b_data + offset, buf, size);
+            set[i].bad &= ~((uint64_t) 1 << (offset / meta_item_size[set[i].kind]));
+        }
+    }
+    pthread_mutex_unlock(&fs->meta_cache_lock);
 }
 
-uint8_t read_inode(FILE *fs, uint64_t inodei, ffs_inode_t *inode) {
-    // read superblock
-    ffs_sb_t sb;
-    if (read_superblock(fs, &sb) == EXIT_FAILURE) {
+uint64_t meta_preload(ffs_fs_t *fs, uint32_t blockno, uint64_t count, uint8_t kind, uint64_t base, uint8_t load) {
+    if (blockno == 0 || count == 0 || blockno + count > fs->sb.sb_blocks_count) {
+        return 0;
+    }
+
+    ffs_block_t *blocks;
+    uint64_t *seen;
+    if ((blocks = malloc(count * sizeof(ffs_block_t))) == NULL) {
+        return 0;
+    }
+    if ((seen = malloc(count * sizeof(uint64_t))) == NULL) {
+        free(blocks);
+        return 0;
+    }
+
+    // blocks written while the run is being read are left out, the read may have returned old contents
+    pthread_mutex_lock(&fs->meta_cache_lock);
+    for (uint64_t i = 0; i < count; ++i) {
+        seen[i] = fs->meta_cache_writes[(blockno + i) % FFS_META_CACHE_SETS];
+    }
+    pthread_mutex_unlock(&fs->meta_cache_lock);
+
+    if (preadbuff(fs->fd, blocks, count * sizeof(ffs_block_t), (off_t) blockno * sizeof(ffs_block_t)) !=
+        (ssize_t) (count * sizeof(ffs_block_t))) {
+        free(seen);
+        free(blocks);
+        return 0;
+    }
+
+    // items of following blocks continue where the previous block ended
+    uint64_t per_block = sizeof(ffs_block_t) / meta_item_size[kind], added = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t bad = meta_verify(fs, kind, base + i * per_block, blockno + i, &blocks[i]);
+        pthread_mutex_lock(&fs->meta_cache_lock);
+        if (fs->meta_cache_writes[(blockno + i) % FFS_META_CACHE_SETS] == seen[i]) {
+            added += meta_insert(fs, blockno + i, kind, base + i * per_block, bad, &blocks[i], load);
+        }
+        pthread_mutex_unlock(&fs->meta_cache_lock);
+    }
+
+    free(seen);
+    free(blocks);
+    return added;
+}
+
+uint64_t ffs_inode_size(ffs_inode_t *inode) {
+    if (S_ISREG(inode->i_mode)) {
+        return inode->i_size | (uint64_t) inode->i_size_high << 32;
+    }
+    return inode->i_size;
+}
+
+void ffs_inode_set_size(ffs_inode_t *inode, uint64_t size) {
+    inode->i_size = size & 0xffffffff;
+    inode->i_size_high = S_ISREG(inode->i_mode) ? size >> 32 : 0;
+}
+
+uint8_t read_bgd(ffs_fs_t *fs, uint64_t gbn, ffs_bgd_t *bgd) {
+    uint64_t per_block = sizeof(ffs_block_t) / sizeof(ffs_bgd_t);
+    return meta_read(fs, 1 + gbn / per_block, FFS_META_DESCRIPTORS, gbn - gbn % per_block,
+                     gbn % per_block * sizeof(ffs_bgd_t), bgd, sizeof(ffs_bgd_t), FFS_META_DEMAND);
+}
+
+uint8_t inode_location(ffs_fs_t *fs, uint64_t inodei, uint32_t *blockno, size_t *offset) {
+    if (inodei == 0 || inodei > fs->sb.sb_inodes_count) {
+        errno = EINVAL;
         return EXIT_FAILURE;
     }
 
     // decrease inode index, because they are counted from 1
     inodei--;
     // block group number
-    uint64_t gbn = inodei / sb.sb_inodes_per_group;
+    uint64_t gbn = inodei / fs->sb.sb_inodes_per_group;
     // inode index in its table
-    uint64_t i_index = inodei % sb.sb_inodes_per_group;
+    uint64_t i_index = inodei % fs->sb.sb_inodes_per_group;
 
-    // move file pointer to block group descriptor
-    if (fseek(fs, sizeof(ffs_block_t) + gbn * sizeof(ffs_bgd_t), SEEK_SET) == -1) {
+    ffs_bgd_t bgd;
+    if (read_bgd(fs, gbn, &bgd) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
-    // read block group descriptor
-    ffs_bgd_t bgd;
-    if (fread(&bgd, sizeof(ffs_bgd_t), 1, fs) != 1) {
+    *blockno = bgd.bgd_inode_table + i_index * sizeof(ffs_inode_t) / sizeof(ffs_block_t);
+    *offset = i_index * sizeof(ffs_inode_t) % sizeof(ffs_block_t);
+    return EXIT_SUCCESS;
+}
+
+uint8_t read_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode) {
+    return prefetch_inode(fs, inodei, inode, FFS_META_DEMAND);
+}
+
+uint8_t prefetch_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode, uint8_t load) {
+    uint32_t blockno;
+    size_t offset;
+    if (inode_location(fs, inodei, &blockno, &offset) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
-    // move file pointer to inode
-    if (fseek(fs, sizeof(ffs_block_t) * bgd.bgd_inode_table + i_index * sizeof(ffs_inode_t), SEEK_SET) == -1) {
+    // first inode of the block seeds checksums of the rest
+    uint64_t first = inodei - offset / sizeof(ffs_inode_t);
+    return meta_read(fs, blockno, FFS_META_INODES, first, offset, inode, sizeof(ffs_inode_t), load);
+}
+
+uint8_t read_dir_block(ffs_fs_t *fs, uint32_t blockno, ffs_block_t *block) {
+    return meta_read(fs, blockno, FFS_META_DIRECTORY, blockno, 0, block, sizeof(ffs_block_t), FFS_META_DEMAND);
+}
+
+uint64_t ffs_meta_blocks(uint64_t blocks) {
+    if (blocks <= FFS_DIRECT_BLOCKS) {
+        return 0;
+    }
+    blocks -= FFS_DIRECT_BLOCKS;
+
+    uint64_t meta = 0, capacity = 1;
+    // single, double and triple indirect trees
+    for (uint8_t level = 1; level <= 3 && blocks > 0; ++level) {
+        capacity *= FFS_ADDR_PER_BLOCK;
+        uint64_t taken = blocks < capacity ? blocks : capacity;
+        // count indirect blocks on every level of the tree
+        uint64_t span = 1;
+        for (uint8_t i = 0; i < level; ++i) {
+            span *= FFS_ADDR_PER_BLOCK;
+            meta += (taken + span - 1) / span;
+        }
+        blocks -= taken;
+    }
+
+    return meta;
+}
+
+uint8_t ffs_bmap_extent(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block, uint32_t *blockno, uint64_t *extent) {
+    *blockno = 0;
+    *extent = 1;
+
+    // inline data has no blocks, its block map holds file contents
+    if (inode->i_flags & FFS_INODE_INLINE_DATA) {
+        return EXIT_SUCCESS;
+    }
+
+    if (block < FFS_DIRECT_BLOCKS) {
+        *blockno = inode->i_block[block];
+        return EXIT_SUCCESS;
+    }
+    block -= FFS_DIRECT_BLOCKS;
+
+    // find the indirect tree the block belongs to
+    uint8_t level = 1;
+    uint64_t span = FFS_ADDR_PER_BLOCK;
+    while (block >= span) {
+        block -= span;
+        if (++level > 3) {
+            *extent = UINT64_MAX;
+            return EXIT_SUCCESS;
+        }
+        span *= FFS_ADDR_PER_BLOCK;
+    }
+
+    // walk down the tree, indirect blocks are cached like the rest of metadata
+    uint32_t pointer = inode->i_block[FFS_DIRECT_BLOCKS + level - 1];
+    while (level-- > 0 && pointer != 0) {
+        span /= FFS_ADDR_PER_BLOCK;
+        if (meta_read(fs, pointer, FFS_META_INDIRECT, 0, (block / span) * sizeof(uint32_t), &pointer,
+                      sizeof(uint32_t), FFS_META_DEMAND) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        block %= span;
+    }
+
+    // missing pointer leaves the rest of the subtree it would have addressed unmapped
+    *blockno = pointer;
+    if (pointer == 0) {
+        *extent = span - block;
+    }
+    return EXIT_SUCCESS;
+}
+
+uint32_t ffs_bmap(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block) {
+    uint32_t blockno;
+    uint64_t extent;
+    if (ffs_bmap_extent(fs, inode, block, &blockno, &extent) == EXIT_FAILURE) {
+        return 0;
+    }
+    return blockno;
+}
+
+uint8_t ffs_unmap_block(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t block, uint32_t *freed) {
+    *freed = 0;
+    if (block < FFS_DIRECT_BLOCKS) {
+        *freed = inode->i_block[block];
+        inode->i_block[block] = 0;
+        return EXIT_SUCCESS;
+    }
+    block -= FFS_DIRECT_BLOCKS;
+
+    uint8_t level = 1;
+    uint64_t span = FFS_ADDR_PER_BLOCK;
+    while (block >= span) {
+        block -= span;
+        if (++level > 3) {
+            return EXIT_SUCCESS;
+        }
+        span *= FFS_ADDR_PER_BLOCK;
+    }
+
+    // find the last indirect block on the way, its entry is the one cleared
+    uint32_t holder = 0, pointer = inode->i_block[FFS_DIRECT_BLOCKS + level - 1];
+    size_t position = 0;
+    while (level-- > 0 && pointer != 0) {
+        span /= FFS_ADDR_PER_BLOCK;
+        holder = pointer;
+        position = (block / span) * sizeof(uint32_t);
+        if (meta_read(fs, holder, FFS_META_INDIRECT, 0, position, &pointer, sizeof(uint32_t), FFS_META_DEMAND) ==
+            EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        block %= span;
+    }
+    if (pointer == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    uint32_t zero = 0;
+    if (pwritebuff(fs->fd, &zero, sizeof(zero), (off_t) holder * sizeof(ffs_block_t) + position) == -1) {
         return EXIT_FAILURE;
     }
+    meta_update(fs, holder, position, &zero, sizeof(zero));
+    *freed = pointer;
+    return EXIT_SUCCESS;
+}
 
-    // read inode
-    if (fread(inode, sizeof(ffs_inode_t), 1, fs) != 1) {
+// superblock is rewritten whole, its checksum covers all of it
+static uint8_t write_superblock(ffs_fs_t *fs) {
+    if (fs->sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        fs->sb.sb_checksum = ffs_sb_checksum(&fs->sb);
+    }
+    if (pwritebuff(fs->fd, &fs->sb, sizeof(ffs_sb_t), 1024) == -1) {
         return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
+}
+
+uint8_t ffs_free_blocks(ffs_fs_t *fs, uint32_t *blocknos, uint64_t count) {
+    uint8_t csum = (fs->sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+    uint64_t per_block = sizeof(ffs_block_t) / sizeof(ffs_bgd_t);
+
+    // every group's bitmap and descriptor are written once for all of its blocks
+    for (uint64_t i = 0; i < count;) {
+        uint64_t gbn = blocknos[i] / fs->sb.sb_blocks_per_group;
+
+        ffs_bgd_t bgd;
+        ffs_block_t bitmap;
+        if (read_bgd(fs, gbn, &bgd) == EXIT_FAILURE ||
+            preadbuff(fs->fd, &bitmap, sizeof(bitmap), (off_t) bgd.bgd_block_bitmap * sizeof(ffs_block_t)) !=
+            sizeof(bitmap)) {
+            errno = errno == 0 ? EIO : errno;
+            return EXIT_FAILURE;
+        }
+        // a damaged bitmap must not get a fresh checksum over it
+        if (csum && bgd.bgd_block_bitmap_csum != ffs_bitmap_checksum(bgd.bgd_block_bitmap, bitmap.b_data)) {
+            fprintf(stderr, "ffs: checksum mismatch in block %u\n", bgd.bgd_block_bitmap);
+            errno = EBADMSG;
+            return EXIT_FAILURE;
+        }
+
+        uint64_t freed = 0;
+        for (; i < count && blocknos[i] / fs->sb.sb_blocks_per_group == gbn; ++i) {
+            uint16_t bit = blocknos[i] % fs->sb.sb_blocks_per_group;
+            if (bitmap_get_bit(bitmap.b_data, bit)) {
+                bitmap_set_bit(bitmap.b_data, bit, 0);
+                freed++;
+            }
+        }
+
+        bgd.bgd_free_blocks_count += freed;
+        if (csum) {
+            bgd.bgd_block_bitmap_csum = ffs_bitmap_checksum(bgd.bgd_block_bitmap, bitmap.b_data);
+            bgd.bgd_checksum = ffs_bgd_checksum(gbn, &bgd);
+        }
+
+        size_t position = gbn % per_block * sizeof(ffs_bgd_t);
+        uint32_t table = 1 + gbn / per_block;
+        if (pwritebuff(fs->fd, &bitmap, sizeof(bitmap), (off_t) bgd.bgd_block_bitmap * sizeof(ffs_block_t)) == -1 ||
+            pwritebuff(fs->fd, &bgd, sizeof(bgd), (off_t) table * sizeof(ffs_block_t) + position) == -1) {
+            return EXIT_FAILURE;
+        }
+        meta_update(fs, table, position, &bgd, sizeof(bgd));
+        fs->sb.sb_free_blocks_count += freed;
+    }
+
+    return write_superblock(fs);
+}
+
+uint8_t ffs_set_feature_incompat(ffs_fs_t *fs, uint32_t feature) {
+    if (fs->sb.sb_feature_incompat & feature) {
+        return EXIT_SUCCESS;
+    }
+    fs->sb.sb_feature_incompat |= feature;
+    return write_superblock(fs);
+}
+
+static uint8_t cluster_cache_get(ffs_fs_t *fs, uint32_t blockno, uint8_t *data, size_t size) {
+    uint8_t found = 0;
+    pthread_mutex_lock(&fs->cluster_cache_lock);
+    for (size_t i = 0; i < FFS_CLUSTER_CACHE_SIZE; ++i) {
+        if (fs->cluster_cache[i].blockno == blockno && fs->cluster_cache[i].size == size) {
+            fs->cluster_cache[i].used = ++fs->cluster_cache_clock;
+            memcpy(data, fs->cluster_cache[i].data, size);
+            found = 1;
+            break;
+        }
+    }
+    if (found) {
+        fs->cluster_cache_hits++;
+    } else {
+        fs->cluster_cache_misses++;
+    }
+    pthread_mutex_unlock(&fs->cluster_cache_lock);
+    return found;
+}
+
+static void cluster_cache_put(ffs_fs_t *fs, uint32_t blockno, uint8_t *data, size_t size) {
+    pthread_mutex_lock(&fs->cluster_cache_lock);
+    // replace least recently used entry
+    size_t victim = 0;
+    for (size_t i = 1; i < FFS_CLUSTER_CACHE_SIZE; ++i) {
+        if (fs->cluster_cache[i].used < fs->cluster_cache[victim].used) {
+            victim = i;
+        }
+    }
+    fs->cluster_cache[victim].blockno = blockno;
+    fs->cluster_cache[victim].used = ++fs->cluster_cache_clock;
+    fs->cluster_cache[victim].size = size;
+    memcpy(fs->cluster_cache[victim].data, data, size);
+    pthread_mutex_unlock(&fs->cluster_cache_lock);
+}
 
+// reads listed blocks, merging physically contiguous ones into a single read
+static uint8_t read_blocks(ffs_fs_t *fs, uint32_t *blocknos, uint64_t count, uint8_t *data) {
+    for (uint64_t i = 0; i < count;) {
+        uint64_t run = 1;
+        while (i + run < count && blocknos[i + run] == blocknos[i] + run) {
+            run++;
+        }
+        size_t size = run * sizeof(ffs_block_t);
+        if (preadbuff(fs->fd, data + i * sizeof(ffs_block_t), size, (off_t) blocknos[i] * sizeof(ffs_block_t)) !=
+            (ssize_t) size) {
+            errno = errno == 0 ? EIO : errno;
+            return EXIT_FAILURE;
+        }
+        i += run;
+    }
     return EXIT_SUCCESS;
 }
 
-int64_t entry_inode_no(FILE *fs, ffs_inode_t *inode, char *entry_name) {
+// reads a cluster of compressed inode, returns number of file bytes in it or -1 on failure
+static int64_t read_cluster(ffs_fs_t *fs, ffs_inode_t *inode, uint64_t cluster, uint8_t *data) {
+    uint64_t size = ffs_inode_size(inode) - cluster * FFS_CLUSTER_SIZE;
+    if (size > FFS_CLUSTER_SIZE) {
+        size = FFS_CLUSTER_SIZE;
+    }
+    uint64_t blocks = (size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+
+    // stored blocks come first, unused entries of the cluster are zero
+    uint32_t blocknos[FFS_CLUSTER_BLOCKS];
+    uint64_t stored = 0;
+    for (uint64_t i = 0; i < blocks; ++i) {
+        uint64_t extent;
+        if (ffs_bmap_extent(fs, inode, cluster * FFS_CLUSTER_BLOCKS + i, &blocknos[i], &extent) == EXIT_FAILURE) {
+            return -1;
+        }
+        if (blocknos[i] != 0) {
+            stored = i + 1;
+        }
+    }
+
+    if (stored == 0) {
+        memset(data, 0, size);
+        return size;
+    }
+
+    // incompressible clusters are kept as is
+    if (stored == blocks) {
+        uint8_t raw[FFS_CLUSTER_SIZE];
+        if (read_blocks(fs, blocknos, blocks, raw) == EXIT_FAILURE) {
+            return -1;
+        }
+        memcpy(data, raw, size);
+        return size;
+    }
+
+    if (cluster_cache_get(fs, blocknos[0], data, size)) {
+        return size;
+    }
+
+    uint8_t packed[FFS_CLUSTER_SIZE];
+    if (read_blocks(fs, blocknos, stored, packed) == EXIT_FAILURE) {
+        return -1;
+    }
+    uint32_t len;
+    memcpy(&len, packed, FFS_CLUSTER_HEADER_LENGTH);
+    if (len > stored * FFS_BLOCKSIZE - FFS_CLUSTER_HEADER_LENGTH ||
+        ffs_lz_decompress(packed + FFS_CLUSTER_HEADER_LENGTH, len, data, FFS_CLUSTER_SIZE) != (ssize_t) size) {
+        errno = EIO;
+        return -1;
+    }
+    cluster_cache_put(fs, blocknos[0], data, size);
+
+    return size;
+}
+
+int64_t read_inode_data(ffs_fs_t *fs, ffs_inode_t *inode, void *buf, size_t size, uint64_t offset) {
+    // nothing to read past the end of file
+    uint64_t file_size = ffs_inode_size(inode);
+    if (offset >= file_size) {
+        return 0;
+    }
+    if (offset + size > file_size) {
+        size = file_size - offset;
+    }
+
+    // tiny files and symlinks live inside the inode
+    if (inode->i_flags & FFS_INODE_INLINE_DATA) {
+        if (file_size > FFS_INLINE_DATA_MAX) {
+            errno = EIO;
+            return -1;
+        }
+        memcpy(buf, inode->i_data + offset, size);
+        return size;
+    }
+
+    // compressed files are read cluster by cluster through the cache
+    if (inode->i_flags & FFS_INODE_COMPRESSED) {
+        uint8_t cluster[FFS_CLUSTER_SIZE];
+        size_t done = 0;
+        while (done < size) {
+            size_t cluster_offset = (offset + done) % FFS_CLUSTER_SIZE;
+            int64_t len = read_cluster(fs, inode, (offset + done) / FFS_CLUSTER_SIZE, cluster);
+            if (len < 0) {
+                return -1;
+            }
+            if (len <= (int64_t) cluster_offset) {
+                errno = EIO;
+                return -1;
+            }
+
+            size_t n = len - cluster_offset < size - done ? len - cluster_offset : size - done;
+            memcpy((uint8_t *) buf + done, cluster + cluster_offset, n);
+            done += n;
+        }
+        return done;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t block = (offset + done) / sizeof(ffs_block_t);
+        uint32_t blockno;
+        uint64_t extent;
+        if (ffs_bmap_extent(fs, inode, block, &blockno, &extent) == EXIT_FAILURE) {
+            return -1;
+        }
+
+        // holes are zeros without any disk access, a missing indirect block skips everything under it
+        size_t len = sizeof(ffs_block_t) - (offset + done) % sizeof(ffs_block_t);
+        if (blockno == 0) {
+            // no more than the request covers, extent past the last tree is unbounded
+            uint64_t limit = size / sizeof(ffs_block_t) + 1;
+            len += ((extent < limit ? extent : limit) - 1) * sizeof(ffs_block_t);
+            if (len > size - done) {
+                len = size - done;
+            }
+            memset((uint8_t *) buf + done, 0, len);
+            done += len;
+            continue;
+        }
+
+        // extend the read over physically contiguous blocks
+        for (uint32_t run = 1; done + len < size; ++run) {
+            uint32_t next;
+            if (ffs_bmap_extent(fs, inode, block + run, &next, &extent) == EXIT_FAILURE) {
+                return -1;
+            }
+            if (next != blockno + run) {
+                break;
+            }
+            len += sizeof(ffs_block_t);
+        }
+        if (len > size - done) {
+            len = size - done;
+        }
+
+        // read the whole run
+        off_t position = (off_t) blockno * sizeof(ffs_block_t) + (offset + done) % sizeof(ffs_block_t);
+        if (preadbuff(fs->fd, (uint8_t *) buf + done, len, position) != (ssize_t) len) {
+            errno = errno == 0 ? EIO : errno;
+            return -1;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+ffs_de_t *dir_entry_at(ffs_block_t *block, size_t pos) {
+    // entry header must fit into the block
+    if (pos + FFS_DIR_ENTRY_HEADER_LENGTH > sizeof(ffs_block_t)) {
+        return NULL;
+    }
+
+    // records are either fixed-size or packed, both are walked by their record length
+    ffs_de_t *de = (ffs_de_t *) (block->b_data + pos);
+    // zero record length terminates the block
+    if (de->de_rec_len == 0 || de->de_name_len > FFS_FILENAME_MAX_LENGTH ||
+        de->de_rec_len < FFS_DIR_ENTRY_HEADER_LENGTH + de->de_name_len ||
+        pos + de->de_rec_len > sizeof(ffs_block_t)) {
+        return NULL;
+    }
+
+    return de;
+}
+
+int64_t entry_inode_no(ffs_fs_t *fs, ffs_inode_t *inode, const char *entry_name) {
+    if (!S_ISDIR(inode->i_mode)) {
+        errno = ENOTDIR;
+        return EXIT_FAILURE;
+    }
+
     // number of blocks used by inode
     uint64_t blocks = inode->i_size / sizeof(ffs_block_t);
-    if (blocks > 12) {
-        blocks = 12;
-    }
+    size_t namelen = strlen(entry_name);
 
     // for each block
-    for (size_t block = 0; block < blocks; ++block) {
-        // move file pointer to record length of the first directory entry on the block
-        if (fseek(fs, sizeof(ffs_block_t) * inode->i_block[block] + 4, SEEK_SET) == -1) {
+    for (uint64_t block = 0; block < blocks; ++block) {
+        ffs_block_t data;
+        if (read_dir_block(fs, ffs_bmap(fs, inode, block), &data) == EXIT_FAILURE) {
             return EXIT_FAILURE;
         }
 
-        uint16_t rl;
-        do {
-            // read entry length
-            if (fread(&rl, 2, 1, fs) != 1) {
-                return EXIT_FAILURE;
-            }
-            // if entry exists
-            if (rl != 0) {
-                uint16_t namelen;
-                // read entry name length
-                if (fread(&namelen, 2, 1, fs) != 1) {
-                    return EXIT_FAILURE;
-                }
-                // allocate memory for the name
-                char name[248];
-                // read the name
-                if (fread(name, namelen, 1, fs) != 1) {
-                    return EXIT_FAILURE;
-                }
-                name[namelen] = '\0';
-                // compare found entry with needed
-                if (strcmp(name, entry_name) == 0) {
-                    // go back to entry inode index
-                    if (fseek(fs, -namelen - 8, SEEK_CUR) == -1) {
-                        return EXIT_FAILURE;
-                    }
-                    // read entry inode index
-                    uint32_t inode_no;
-                    if (fread(&inode_no, 4, 1, fs) != 1) {
-                        return EXIT_FAILURE;
-                    }
-                    return inode_no;
-                }
-                // move file pointer to next entry's record length
-                if (fseek(fs, rl - namelen - 4, SEEK_CUR) == -1) {
-                    return EXIT_FAILURE;
-                }
+        ffs_de_t *de;
+        for (size_t pos = 0; (de = dir_entry_at(&data, pos)) != NULL; pos += de->de_rec_len) {
+            // compare found entry with needed
+            if (de->de_inode != 0 && de->de_name_len == namelen && memcmp(de->de_name, entry_name, namelen) == 0) {
+                return de->de_inode;
             }
-        } while (rl != 0);
+        }
     }
 
+    errno = ENOENT;
     return EXIT_FAILURE;
 }
 
-int64_t path_to_inode(FILE *fs, const char *path) {
-    // inode number of root directory has fixed value of 2
-    if (strcmp(path, "/") == 0) {
-        return 2;
-    }
-
+int64_t path_to_inode(ffs_fs_t *fs, const char *path) {
     // start from root directory
-    uint64_t inodeno = 2;
+    uint64_t inodeno = FFS_ROOT_INODE;
     ffs_inode_t inode;
 
     size_t i = 1, start = 1;
-    char c = path[i];
+    char c;
     do {
+        c = path[i];
         // path node
-        if ((c == '/') || (c == 0)) {
+        if (((c == '/') || (c == 0)) && (i > start)) {
+            if (i - start > FFS_FILENAME_MAX_LENGTH) {
+                errno = ENAMETOOLONG;
+                return EXIT_FAILURE;
+            }
+
             // read inode by its index
             if (read_inode(fs, inodeno, &inode) == EXIT_FAILURE) {
                 return EXIT_FAILURE;
@@ -166,55 +806,38 @@ int64_t path_to_inode(FILE *fs, const char *path) {
 
             // copy entry name
             memcpy(entry_name, path + start, i - start);
-            entry_name[i - start + 1] = '\0';
+            entry_name[i - start] = '\0';
 
             // get inode index by its name
             if ((inodeno = entry_inode_no(fs, &inode, entry_name)) == EXIT_FAILURE) {
                 return EXIT_FAILURE;
             }
+        }
+        if (c == '/') {
             start = i + 1;
         }
         i++;
-    } while ((c = path[i]) != 0);
+    } while (c != 0);
 
     return inodeno;
 }
 
-uint8_t write_inode(FILE *fs, uint64_t inodei, ffs_inode_t *inode) {
-    // read superblock
-    ffs_sb_t sb;
-    if (read_superblock(fs, &sb) == EXIT_FAILURE) {
-        fclose(fs);
-        return EXIT_FAILURE;
-    }
-
-    // decrease inode index, because they are counted from 1
-    inodei--;
-    // block group number
-    uint64_t gbn = inodei / sb.sb_inodes_per_group;
-    // inode index in its table
-    uint64_t i_index = inodei % sb.sb_inodes_per_group;
-
-    // move file pointer to block group descriptor
-    if (fseek(fs, sizeof(ffs_block_t) + gbn * sizeof(ffs_bgd_t), SEEK_SET) == -1) {
-        return EXIT_FAILURE;
-    }
-
-    // read block group descriptor
-    ffs_bgd_t bgd;
-    if (fread(&bgd, sizeof(ffs_bgd_t), 1, fs) != 1) {
+uint8_t write_inode(ffs_fs_t *fs, uint64_t inodei, ffs_inode_t *inode) {
+    uint32_t blockno;
+    size_t offset;
+    if (inode_location(fs, inodei, &blockno, &offset) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
-    // move file pointer to inode
-    if (fseek(fs, sizeof(ffs_block_t) * bgd.bgd_inode_table + i_index * sizeof(ffs_inode_t), SEEK_SET) == -1) {
-        return EXIT_FAILURE;
+    if (fs->sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        inode->i_checksum = ffs_inode_checksum(inodei, inode);
     }
 
     // write inode
-    if (fwrite(inode, sizeof(ffs_inode_t), 1, fs) != 1) {
+    if (pwritebuff(fs->fd, inode, sizeof(ffs_inode_t), (off_t) blockno * sizeof(ffs_block_t) + offset) == -1) {
         return EXIT_FAILURE;
     }
+    meta_update(fs, blockno, offset, inode, sizeof(ffs_inode_t));
 
     return EXIT_SUCCESS;
 }
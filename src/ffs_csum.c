@@ -0,0 +1,155 @@
+#include "ffs_csum.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define FFS_CRC32C_X86
+#endif
+
+// reversed Castagnoli polynomial
+#define FFS_CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t size);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// slicing by 8, on-disk format is little-endian anyway
+static uint32_t crc32c_update_portable(uint32_t crc, const uint8_t *p, size_t size) {
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef FFS_CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+    crc = crc64;
+#endif
+    while (size >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        size -= 4;
+    }
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (uint8_t k = 0; k < 8; ++k) {
+            crc = crc & 1 ? (crc >> 1) ^ FFS_CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (uint8_t t = 1; t < 8; ++t) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+
+    // implementation is picked once at runtime, so one binary runs everywhere
+    crc32c_update = crc32c_update_portable;
+#ifdef FFS_CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_update_sse42;
+    }
+#endif
+}
+
+uint32_t ffs_crc32c(uint32_t crc, const void *buffer, size_t size) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, buffer, size);
+}
+
+uint32_t ffs_crc32c_portable(uint32_t crc, const void *buffer, size_t size) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update_portable(~crc, buffer, size);
+}
+
+uint8_t ffs_crc32c_accelerated(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_update != crc32c_update_portable;
+}
+
+static uint32_t ffs_csum_seed(uint64_t location) {
+    uint32_t seed = location;
+    return ffs_crc32c(0, &seed, sizeof(seed));
+}
+
+uint32_t ffs_sb_checksum(ffs_sb_t *sb) {
+    return ffs_crc32c(ffs_csum_seed(0), sb, offsetof(ffs_sb_t, sb_checksum));
+}
+
+uint16_t ffs_bgd_checksum(uint64_t gbn, ffs_bgd_t *bgd) {
+    return ffs_crc32c(ffs_csum_seed(gbn), bgd, offsetof(ffs_bgd_t, bgd_checksum)) & 0xffff;
+}
+
+uint16_t ffs_bitmap_checksum(uint32_t blockno, uint8_t *bitmap) {
+    return ffs_crc32c(ffs_csum_seed(blockno), bitmap, FFS_BLOCKSIZE) & 0xffff;
+}
+
+uint32_t ffs_inode_checksum(uint64_t inodei, ffs_inode_t *inode) {
+    // checksum field itself is skipped
+    size_t after = offsetof(ffs_inode_t, i_checksum) + sizeof(inode->i_checksum);
+    uint32_t crc = ffs_crc32c(ffs_csum_seed(inodei), inode, offsetof(ffs_inode_t, i_checksum));
+    return ffs_crc32c(crc, (uint8_t *) inode + after, sizeof(ffs_inode_t) - after);
+}
+
+uint8_t ffs_inode_verify(uint64_t inodei, ffs_inode_t *inode) {
+    static const ffs_inode_t unused;
+    if (memcmp(inode, &unused, sizeof(ffs_inode_t)) == 0) {
+        return EXIT_SUCCESS;
+    }
+    return inode->i_checksum == ffs_inode_checksum(inodei, inode) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+uint32_t ffs_dir_block_checksum(uint32_t blockno, ffs_block_t *block) {
+    return ffs_crc32c(ffs_csum_seed(blockno), block, sizeof(ffs_block_t) - sizeof(uint32_t));
+}
+
+void ffs_dir_block_seal(uint32_t blockno, ffs_block_t *block) {
+    ffs_dt_t *tail = (ffs_dt_t *) (block->b_data + sizeof(ffs_block_t) - sizeof(ffs_dt_t));
+    tail->dt_inode = 0;
+    tail->dt_rec_len = sizeof(ffs_dt_t);
+    tail->dt_name_len = 0;
+    tail->dt_checksum = ffs_dir_block_checksum(blockno, block);
+}
+
+uint8_t ffs_dir_block_verify(uint32_t blockno, ffs_block_t *block) {
+    ffs_dt_t *tail = (ffs_dt_t *) (block->b_data + sizeof(ffs_block_t) - sizeof(ffs_dt_t));
+    if (tail->dt_inode != 0 || tail->dt_rec_len != sizeof(ffs_dt_t) || tail->dt_name_len != 0 ||
+        tail->dt_checksum != ffs_dir_block_checksum(blockno, block)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#include "ffs_csum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// metadata is checksummed in 2 KiB blocks, so that is what gets measured
+#define FFS_BENCH_BUFFER_BLOCKS 8192
+
+static uint8_t buffer[FFS_BENCH_BUFFER_BLOCKS][FFS_BLOCKSIZE];
+static volatile uint32_t sink;
+
+static double ffs_bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ffs_bench_report(const char *name, double seconds, uint64_t bytes) {
+    double gigabytes = bytes / (double) (1 << 30);
+    printf("%-32s %8.3f s/GB %8.2f GB/s\n", name, seconds / gigabytes, gigabytes / seconds);
+}
+
+static void ffs_bench_crc(const char *name, uint32_t (*crc)(uint32_t, const void *, size_t), uint64_t blocks) {
+    double start = ffs_bench_now();
+    uint32_t value = 0;
+    for (uint64_t i = 0; i < blocks; ++i) {
+        value ^= crc(0, buffer[i % FFS_BENCH_BUFFER_BLOCKS], FFS_BLOCKSIZE);
+    }
+    sink = value;
+    ffs_bench_report(name, ffs_bench_now() - start, blocks * FFS_BLOCKSIZE);
+}
+
+int main(int argc, char *argv[], char *envp[]) {
+    uint64_t gigabytes = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+    if (gigabytes == 0) {
+        fprintf(stderr, "Usage: ffs_csum_bench [gigabytes]\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t blocks = gigabytes * (1 << 30) / FFS_BLOCKSIZE;
+
+    // something that looks like metadata, not zeros
+    srand(1);
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        ((uint8_t *) buffer)[i] = rand();
+    }
+
+    printf("crc32c: %s, %lu GB of %d byte blocks\n\n", ffs_crc32c_accelerated() ? "SSE4.2" : "portable",
+           gigabytes, FFS_BLOCKSIZE);
+
+    ffs_bench_crc("crc32c portable", ffs_crc32c_portable, blocks);
+    ffs_bench_crc("crc32c runtime selected", ffs_crc32c, blocks);
+
+    // directory blocks: seal once, verify on load
+    for (uint64_t i = 0; i < FFS_BENCH_BUFFER_BLOCKS; ++i) {
+        ffs_dir_block_seal(i, (ffs_block_t *) buffer[i]);
+    }
+    double start = ffs_bench_now();
+    uint64_t failed = 0;
+    for (uint64_t i = 0; i < blocks; ++i) {
+        failed += ffs_dir_block_verify(i % FFS_BENCH_BUFFER_BLOCKS, (ffs_block_t *) buffer[i % FFS_BENCH_BUFFER_BLOCKS]);
+    }
+    ffs_bench_report("directory block verify", ffs_bench_now() - start, blocks * FFS_BLOCKSIZE);
+
+    // inode table blocks: every inode has its own checksum
+    uint64_t per_block = FFS_BLOCKSIZE / sizeof(ffs_inode_t);
+    for (uint64_t i = 0; i < FFS_BENCH_BUFFER_BLOCKS; ++i) {
+        ffs_inode_t *inodes = (ffs_inode_t *) buffer[i];
+        for (uint64_t j = 0; j < per_block; ++j) {
+            inodes[j].i_checksum = ffs_inode_checksum(i * per_block + j + 1, &inodes[j]);
+        }
+    }
+    start = ffs_bench_now();
+    for (uint64_t i = 0; i < blocks; ++i) {
+        ffs_inode_t *inodes = (ffs_inode_t *) buffer[i % FFS_BENCH_BUFFER_BLOCKS];
+        for (uint64_t j = 0; j < per_block; ++j) {
+            failed += ffs_inode_verify((i % FFS_BENCH_BUFFER_BLOCKS) * per_block + j + 1, &inodes[j]);
+        }
+    }
+    ffs_bench_report("inode table block verify", ffs_bench_now() - start, blocks * FFS_BLOCKSIZE);
+
+    // bitmaps and descriptors use truncated checksums of the same function
+    start = ffs_bench_now();
+    uint32_t value = 0;
+    for (uint64_t i = 0; i < blocks; ++i) {
+        value ^= ffs_bitmap_checksum(i, buffer[i % FFS_BENCH_BUFFER_BLOCKS]);
+    }
+    sink = value;
+    ffs_bench_report("bitmap checksum", ffs_bench_now() - start, blocks * FFS_BLOCKSIZE);
+
+    if (failed != 0) {
+        fprintf(stderr, "%lu checksums did not verify\n", failed);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,277 @@
+#include "ffs_common.h"
+#include "ffs_extract.h"
+#include "libffs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[], char *envp[]) {
+    printf("ffs-extract 1.0.0 (27-Dec-2019)\n\n");
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: ffs-extract [-j threads] image directory\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: ffs-extract [-j threads] image directory\n");
+        return EXIT_FAILURE;
+    }
+
+    ffs_fs_t *fs;
+    if ((fs = ffs_fs_open(argv[optind], O_RDONLY)) == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if (mkdir(argv[optind + 1], 0700) == -1 && errno != EEXIST) {
+        perror(argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    ffs_extract_t extract;
+    memset(&extract, 0, sizeof(ffs_extract_t));
+    extract.fs = fs;
+    extract.destination = argv[optind + 1];
+    pthread_mutex_init(&extract.lock, NULL);
+
+    ffs_extract_tree(&extract);
+    ffs_extract_files(&extract, threads < 1 ? 1 : threads);
+    ffs_extract_finish(&extract);
+
+    printf("%lu directories, %lu files, %lu symlinks, %lu bytes\n", extract.dirs.count, extract.files.count,
+           extract.symlinks, extract.bytes);
+
+    ffs_extract_free(&extract);
+    ffs_fs_close(fs);
+
+    return EXIT_SUCCESS;
+}
+
+static void ffs_extract_push(ffs_extract_list_t *list, const char *path, uint64_t inodei, struct stat *st,
+                             uint32_t first) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+        if ((list->nodes = realloc(list->nodes, list->capacity * sizeof(ffs_extract_node_t))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ffs_extract_node_t *node = &list->nodes[list->count++];
+    if ((node->path = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    node->inodei = inodei;
+    node->st = *st;
+    node->first = first;
+}
+
+// destination path of a node, relative paths from the walk are appended to the target directory
+static void ffs_extract_path(ffs_extract_t *extract, const char *path, char *out) {
+    if (snprintf(out, PATH_MAX, "%s/%s", extract->destination, path) >= PATH_MAX) {
+        fprintf(stderr, "%s: path too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int ffs_extract_visit(void *arg, const char *path, uint64_t inodei, const struct stat *st) {
+    ffs_extract_t *extract = arg;
+    char target[PATH_MAX];
+    ffs_extract_path(extract, path, target);
+
+    // directories and symlinks are created right away, parents are always visited first
+    if (S_ISDIR(st->st_mode)) {
+        if (mkdir(target, 0700) == -1 && errno != EEXIST) {
+            perror(target);
+            exit(EXIT_FAILURE);
+        }
+        ffs_extract_push(&extract->dirs, path, inodei, (struct stat *) st, 0);
+    } else if (S_ISLNK(st->st_mode)) {
+        char link[PATH_MAX];
+        if (ffs_fs_readlink(extract->fs, inodei, link, sizeof(link)) == EXIT_FAILURE) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        if (symlink(link, target) == -1) {
+            perror(target);
+            exit(EXIT_FAILURE);
+        }
+        extract->symlinks++;
+    } else if (S_ISREG(st->st_mode)) {
+        // file contents are copied later in order of their position in the image
+        ffs_extract_push(&extract->files, path, inodei, (struct stat *) st, ffs_fs_bmap(extract->fs, inodei, 0));
+    }
+
+    return 0;
+}
+
+void ffs_extract_tree(ffs_extract_t *extract) {
+    if (ffs_fs_iterate(extract->fs, FFS_ROOT_INODE, ffs_extract_visit, extract) == EXIT_FAILURE) {
+        perror("walk");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Creating directories: done\n");
+}
+
+static int ffs_extract_compare(const void *a, const void *b) {
+    const ffs_extract_node_t *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static void ffs_extract_attributes(ffs_extract_node_t *node, int fd, const char *target) {
+    struct timespec times[2] = {
+            {.tv_sec = node->st.st_atime},
+            {.tv_sec = node->st.st_mtime}
+    };
+
+    // ownership is only restored for root, others keep their own
+    if (geteuid() == 0 && fchownat(fd, target, node->st.st_uid, node->st.st_gid, 0) == -1) {
+        perror(target);
+    }
+    if (fchmodat(fd, target, node->st.st_mode & 07777, 0) == -1 || utimensat(fd, target, times, 0) == -1) {
+        perror(target);
+    }
+}
+
+static void ffs_extract_file(ffs_extract_t *extract, ffs_extract_node_t *node, uint8_t *buffer) {
+    char target[PATH_MAX];
+    ffs_extract_path(extract, node->path, target);
+
+    int dst;
+    if ((dst = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror(target);
+        exit(EXIT_FAILURE);
+    }
+
+    // only data is copied, holes of the image stay holes of the copy
+    uint64_t size = node->st.st_size, offset = 0, copied = 0;
+    while (offset < size) {
+        int64_t data, hole;
+        if ((data = ffs_fs_lseek(extract->fs, node->inodei, offset, SEEK_DATA)) == -1 && errno == ENXIO) {
+            break;
+        }
+        if (data == -1 || (hole = ffs_fs_lseek(extract->fs, node->inodei, data, SEEK_HOLE)) == -1) {
+            fprintf(stderr, "%s: %s\n", node->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        // large reads let contiguous runs of blocks go out as single preads
+        for (offset = data; offset < (uint64_t) hole;) {
+            uint64_t want = hole - offset < FFS_EXTRACT_CHUNK ? hole - offset : FFS_EXTRACT_CHUNK;
+            int64_t got;
+            if ((got = ffs_fs_read(extract->fs, node->inodei, buffer, want, offset)) <= 0) {
+                fprintf(stderr, "%s: %s\n", node->path, got == 0 ? "unexpected end of file" : strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (pwritebuff(dst, buffer, got, offset) == -1) {
+                perror(target);
+                exit(EXIT_FAILURE);
+            }
+            offset += got;
+            copied += got;
+        }
+    }
+    if (ftruncate(dst, size) == -1) {
+        perror(target);
+        exit(EXIT_FAILURE);
+    }
+
+    ffs_extract_attributes(node, AT_FDCWD, target);
+    close(dst);
+
+    pthread_mutex_lock(&extract->lock);
+    extract->bytes += copied;
+    pthread_mutex_unlock(&extract->lock);
+}
+
+static void *ffs_extract_worker(void *arg) {
+    ffs_extract_t *extract = arg;
+
+    uint8_t *buffer;
+    if ((buffer = malloc(FFS_EXTRACT_CHUNK)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        // take next file in disk order
+        pthread_mutex_lock(&extract->lock);
+        uint64_t i = extract->next++;
+        pthread_mutex_unlock(&extract->lock);
+
+        if (i >= extract->files.count) {
+            break;
+        }
+        ffs_extract_file(extract, &extract->files.nodes[i], buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+void ffs_extract_files(ffs_extract_t *extract, uint64_t threads) {
+    qsort(extract->files.nodes, extract->files.count, sizeof(ffs_extract_node_t), ffs_extract_compare);
+
+    pthread_t *workers;
+    if ((workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t i = 0; i < threads; ++i) {
+        int error;
+        if ((error = pthread_create(&workers[i], NULL, ffs_extract_worker, extract)) != 0) {
+            errno = error;
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint64_t i = 0; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+
+    printf("Copying files: done\n");
+}
+
+void ffs_extract_finish(ffs_extract_t *extract) {
+    // children first, so setting a directory's times is not undone by filling it
+    for (uint64_t i = extract->dirs.count; i > 0; --i) {
+        ffs_extract_node_t *node = &extract->dirs.nodes[i - 1];
+        char target[PATH_MAX];
+        ffs_extract_path(extract, node->path, target);
+        ffs_extract_attributes(node, AT_FDCWD, target);
+    }
+
+    printf("Setting directory attributes: done\n\n");
+}
+
+void ffs_extract_free(ffs_extract_t *extract) {
+    for (uint64_t i = 0; i < extract->dirs.count; ++i) {
+        free(extract->dirs.nodes[i].path);
+    }
+    for (uint64_t i = 0; i < extract->files.count; ++i) {
+        free(extract->files.nodes[i].path);
+    }
+    free(extract->dirs.nodes);
+    free(extract->files.nodes);
+    pthread_mutex_destroy(&extract->lock);
+}
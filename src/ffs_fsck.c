@@ -0,0 +1,740 @@
+#include "ffs_common.h"
+#include "ffs_csum.h"
+#include "ffs_fsck.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[], char *envp[]) {
+    printf("fsck.ffs 1.0.0 (27-Dec-2019)\n");
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: fsck.ffs [-j threads] [filename]\n");
+                return FFS_FSCK_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: fsck.ffs [-j threads] [filename]\n");
+        return FFS_FSCK_FAILURE;
+    }
+
+    ffs_fsck_t fsck;
+    if (ffs_fsck_open(&fsck, argv[optind]) == EXIT_FAILURE) {
+        return FFS_FSCK_FAILURE;
+    }
+
+    printf("Pass 1: Checking inodes, blocks, sizes and directories\n");
+    ffs_fsck_check_groups(&fsck, threads < 1 ? 1 : threads);
+    printf("Pass 2: Checking bitmaps, connectivity, reference counts and group summary information\n");
+    ffs_fsck_check_bitmaps(&fsck, threads < 1 ? 1 : threads);
+    ffs_fsck_check_superblock(&fsck);
+
+    printf("%s: %lu/%u files, %lu/%u blocks\n", argv[optind], fsck.used_inodes, fsck.sb.sb_inodes_count,
+           fsck.used_blocks, fsck.sb.sb_blocks_count);
+
+    int status = fsck.problems == 0 ? FFS_FSCK_OK : FFS_FSCK_ERRORS;
+    if (fsck.problems != 0) {
+        printf("%s: %lu problems found\n", argv[optind], fsck.problems);
+    }
+
+    ffs_fsck_close(&fsck);
+
+    return status;
+}
+
+static uint8_t ffs_bitset_init(ffs_bitset_t *bitset, uint64_t bits) {
+    bitset->bits = bits;
+    bitset->words = calloc((bits + 63) / 64, sizeof(uint64_t));
+    return bitset->words == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// sets the bit and returns its previous value
+static uint8_t ffs_bitset_test_and_set(ffs_bitset_t *bitset, uint64_t bit) {
+    uint64_t mask = (uint64_t) 1 << (bit % 64);
+    return (__atomic_fetch_or(&bitset->words[bit / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static uint8_t ffs_bitset_get(ffs_bitset_t *bitset, uint64_t bit) {
+    return (__atomic_load_n(&bitset->words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
+static void ffs_fsck_problem(ffs_fsck_t *fsck, const char *format, ...) {
+    pthread_mutex_lock(&fsck->lock);
+    fsck->problems++;
+
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+
+    pthread_mutex_unlock(&fsck->lock);
+}
+
+int ffs_fsck_open(ffs_fsck_t *fsck, const char *filename) {
+    memset(fsck, 0, sizeof(ffs_fsck_t));
+    pthread_mutex_init(&fsck->lock, NULL);
+
+    if ((fsck->fd = open(filename, O_RDONLY)) < 0) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    if (preadbuff(fsck->fd, &fsck->sb, sizeof(ffs_sb_t), 1024) != sizeof(ffs_sb_t)) {
+        fprintf(stderr, "%s: cannot read superblock\n", filename);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+
+    // geometry has to be sane before anything else can be checked
+    ffs_sb_t *sb = &fsck->sb;
+    if (sb->sb_magic != FFS_MAGIC) {
+        fprintf(stderr, "%s: bad magic number in superblock\n", filename);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->sb_log_block_size != FFS_LOG_BLOCK_SIZE || sb->sb_blocks_per_group != FFS_BLOCKS_PER_GROUP ||
+        sb->sb_inodes_per_group != FFS_INODES_PER_GROUP || sb->sb_blocks_count == 0 ||
+        sb->sb_blocks_count % FFS_BLOCKS_PER_GROUP != 0 ||
+        sb->sb_inodes_count != sb->sb_blocks_count / FFS_BLOCKS_PER_GROUP * FFS_INODES_PER_GROUP) {
+        fprintf(stderr, "%s: unsupported filesystem geometry in superblock\n", filename);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->sb_feature_incompat & ~FFS_FEATURE_INCOMPAT_SUPPORTED) {
+        fprintf(stderr, "%s: unsupported filesystem features (0x%x)\n", filename,
+                sb->sb_feature_incompat & ~FFS_FEATURE_INCOMPAT_SUPPORTED);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+    if (sb->sb_feature_ro_compat & ~FFS_FEATURE_RO_COMPAT_SUPPORTED) {
+        fprintf(stderr, "%s: unsupported read-only compatible features (0x%x)\n", filename,
+                sb->sb_feature_ro_compat & ~FFS_FEATURE_RO_COMPAT_SUPPORTED);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+    fsck->csum = (sb->sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) != 0;
+    if (fsck->csum && sb->sb_checksum != ffs_sb_checksum(sb)) {
+        ffs_fsck_problem(fsck, "Superblock checksum does not match superblock");
+    }
+
+    fsck->bgn = sb->sb_blocks_count / FFS_BLOCKS_PER_GROUP;
+    fsck->bgdt_blocks = ((fsck->bgn % 64) == 0) ? fsck->bgn / 64 : (fsck->bgn / 64) + 1;
+
+    if ((fsck->bgdt = calloc(fsck->bgn, sizeof(ffs_bgd_t))) == NULL ||
+        ffs_bitset_init(&fsck->blocks, sb->sb_blocks_count) == EXIT_FAILURE ||
+        ffs_bitset_init(&fsck->inodes, (uint64_t) sb->sb_inodes_count + 1) == EXIT_FAILURE ||
+        ffs_bitset_init(&fsck->inodes_twice, (uint64_t) sb->sb_inodes_count + 1) == EXIT_FAILURE ||
+        (fsck->links = calloc((uint64_t) sb->sb_inodes_count + 1, sizeof(ffs_fsck_links_t))) == NULL) {
+        perror("calloc");
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+
+    // read the whole descriptors table at once
+    if (preadbuff(fsck->fd, fsck->bgdt, fsck->bgn * sizeof(ffs_bgd_t), FFS_BLOCKSIZE) !=
+        (ssize_t) (fsck->bgn * sizeof(ffs_bgd_t))) {
+        fprintf(stderr, "%s: cannot read block group descriptors\n", filename);
+        close(fsck->fd);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void ffs_fsck_close(ffs_fsck_t *fsck) {
+    free(fsck->links);
+    free(fsck->inodes_twice.words);
+    free(fsck->inodes.words);
+    free(fsck->blocks.words);
+    free(fsck->bgdt);
+    pthread_mutex_destroy(&fsck->lock);
+    close(fsck->fd);
+}
+
+void ffs_fsck_check_superblock(ffs_fsck_t *fsck) {
+    uint64_t free_blocks = 0, free_inodes = 0;
+    for (uint64_t i = 0; i < fsck->bgn; ++i) {
+        free_blocks += fsck->bgdt[i].bgd_free_blocks_count;
+        free_inodes += fsck->bgdt[i].bgd_free_inodes_count;
+    }
+
+    if (fsck->sb.sb_free_blocks_count != free_blocks) {
+        ffs_fsck_problem(fsck, "Superblock free blocks count wrong (%u, counted=%lu)",
+                         fsck->sb.sb_free_blocks_count, free_blocks);
+    }
+    if (fsck->sb.sb_free_inodes_count != free_inodes) {
+        ffs_fsck_problem(fsck, "Superblock free inodes count wrong (%u, counted=%lu)",
+                         fsck->sb.sb_free_inodes_count, free_inodes);
+    }
+}
+
+// state of a single inode's block map walk
+struct ffs_fsck_walk {
+    ffs_fsck_t *fsck;
+    uint64_t inodei;
+    ffs_inode_t *inode;
+    uint64_t left;
+    uint64_t logical;
+    uint64_t counted;
+    // logical block of an unmapped tail in the current cluster of a compressed inode
+    uint64_t cluster_tail;
+};
+
+static uint8_t ffs_fsck_claim_block(struct ffs_fsck_walk *walk, uint32_t blockno) {
+    if (blockno == 0) {
+        ffs_fsck_problem(walk->fsck, "Inode %lu has unmapped block %lu", walk->inodei, walk->logical);
+        return EXIT_FAILURE;
+    }
+    if (blockno >= walk->fsck->sb.sb_blocks_count) {
+        ffs_fsck_problem(walk->fsck, "Inode %lu has illegal block %u", walk->inodei, blockno);
+        return EXIT_FAILURE;
+    }
+    if (ffs_bitset_test_and_set(&walk->fsck->blocks, blockno)) {
+        ffs_fsck_problem(walk->fsck, "Inode %lu uses block %u which is already in use", walk->inodei, blockno);
+    }
+
+    walk->counted++;
+    return EXIT_SUCCESS;
+}
+
+static void ffs_fsck_dir_block(struct ffs_fsck_walk *walk, uint32_t blockno) {
+    ffs_fsck_t *fsck = walk->fsck;
+
+    ffs_block_t block;
+    if (preadbuff(fsck->fd, &block, sizeof(ffs_block_t), (off_t) blockno * FFS_BLOCKSIZE) != sizeof(ffs_block_t)) {
+        ffs_fsck_problem(fsck, "Cannot read directory block %u of inode %lu", blockno, walk->inodei);
+        return;
+    }
+
+    // checksummed blocks end with a tail record
+    size_t end = sizeof(ffs_block_t);
+    if (fsck->csum) {
+        if (ffs_dir_block_verify(blockno, &block) == EXIT_FAILURE) {
+            ffs_fsck_problem(fsck, "Directory inode %lu, block %lu: checksum does not match directory block",
+                             walk->inodei, walk->logical);
+        }
+        end -= sizeof(ffs_dt_t);
+    }
+
+    uint64_t index = 0;
+    for (size_t pos = 0; pos + FFS_DIR_ENTRY_HEADER_LENGTH <= end; index++) {
+        ffs_de_t *de = (ffs_de_t *) (block.b_data + pos);
+        if (de->de_rec_len == 0) {
+            break;
+        }
+
+        uint16_t rec_len = fsck->sb.sb_feature_incompat & FFS_FEATURE_INCOMPAT_PACKED_DIRS
+                           ? FFS_DIR_PACKED_RECORD_LENGTH(de->de_name_len) : FFS_DIR_ENTRY_RECORD_LENGTH;
+        if (de->de_rec_len != rec_len || de->de_name_len == 0 ||
+            de->de_name_len > FFS_FILENAME_MAX_LENGTH || pos + de->de_rec_len > end) {
+            ffs_fsck_problem(fsck, "Directory inode %lu, block %lu, offset %lu: directory corrupted",
+                             walk->inodei, walk->logical, pos);
+            return;
+        }
+        pos += de->de_rec_len;
+
+        if (de->de_inode == 0) {
+            continue;
+        }
+        if (de->de_inode > fsck->sb.sb_inodes_count) {
+            ffs_fsck_problem(fsck, "Entry '%.*s' in directory inode %lu has bad inode %u",
+                             de->de_name_len, de->de_name, walk->inodei, de->de_inode);
+            continue;
+        }
+        if (memchr(de->de_name, '/', de->de_name_len) != NULL || memchr(de->de_name, 0, de->de_name_len) != NULL) {
+            ffs_fsck_problem(fsck, "Entry '%.*s' in directory inode %lu has illegal characters in its name",
+                             de->de_name_len, de->de_name, walk->inodei);
+        }
+
+        // every entry counts as a link, '..' is matched against the parent once all directories are read
+        __atomic_fetch_add(&fsck->links[de->de_inode].refs, 1, __ATOMIC_RELAXED);
+
+        // first two entries of a directory are '.' and '..'
+        if (walk->logical == 0 && index == 0) {
+            if (de->de_name_len != 1 || de->de_name[0] != '.' || de->de_inode != walk->inodei) {
+                ffs_fsck_problem(fsck, "Missing '.' in directory inode %lu", walk->inodei);
+            }
+            continue;
+        }
+        if (walk->logical == 0 && index == 1) {
+            if (de->de_name_len != 2 || de->de_name[0] != '.' || de->de_name[1] != '.') {
+                ffs_fsck_problem(fsck, "Missing '..' in directory inode %lu", walk->inodei);
+            }
+            __atomic_store_n(&fsck->links[walk->inodei].dotdot, de->de_inode, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        __atomic_store_n(&fsck->links[de->de_inode].parent, (uint32_t) walk->inodei, __ATOMIC_RELAXED);
+        if (ffs_bitset_test_and_set(&fsck->inodes, de->de_inode)) {
+            ffs_bitset_test_and_set(&fsck->inodes_twice, de->de_inode);
+        }
+    }
+}
+
+// passes over everything a missing or broken indirect block would have addressed
+static void ffs_fsck_skip(struct ffs_fsck_walk *walk, uint8_t level) {
+    uint64_t span = 1;
+    for (uint8_t i = 0; i < level; ++i) {
+        span *= FFS_ADDR_PER_BLOCK;
+    }
+    span = span < walk->left ? span : walk->left;
+    walk->logical += span;
+    walk->left -= span;
+}
+
+// holes are allowed in regular files of sparse filesystems only
+static uint8_t ffs_fsck_hole(struct ffs_fsck_walk *walk, uint32_t blockno) {
+    return blockno == 0 && S_ISREG(walk->inode->i_mode) &&
+           (walk->fsck->sb.sb_feature_incompat & FFS_FEATURE_INCOMPAT_SPARSE);
+}
+
+static void ffs_fsck_data_block(struct ffs_fsck_walk *walk, uint32_t blockno) {
+    // compressed clusters keep their blocks at the start and leave the rest unmapped
+    if (walk->inode->i_flags & FFS_INODE_COMPRESSED) {
+        uint64_t cluster = walk->logical / FFS_CLUSTER_BLOCKS;
+        if (blockno == 0) {
+            if (walk->cluster_tail / FFS_CLUSTER_BLOCKS != cluster) {
+                walk->cluster_tail = walk->logical;
+            }
+            walk->logical++;
+            walk->left--;
+            return;
+        }
+        if (walk->cluster_tail / FFS_CLUSTER_BLOCKS == cluster && walk->cluster_tail < walk->logical) {
+            ffs_fsck_problem(walk->fsck, "Inode %lu has mapped block %lu after unmapped one in its cluster",
+                             walk->inodei, walk->logical);
+        }
+    }
+    if (ffs_fsck_hole(walk, blockno)) {
+        walk->logical++;
+        walk->left--;
+        return;
+    }
+
+    if (ffs_fsck_claim_block(walk, blockno) == EXIT_SUCCESS && S_ISDIR(walk->inode->i_mode)) {
+        ffs_fsck_dir_block(walk, blockno);
+    }
+    walk->logical++;
+    walk->left--;
+}
+
+static void ffs_fsck_indirect(struct ffs_fsck_walk *walk, uint8_t level, uint32_t blockno) {
+    // missing indirect block is a hole over its whole subtree, a compressed cluster it cuts into
+    // gets unmapped tail as usual
+    if (ffs_fsck_hole(walk, blockno)) {
+        if (walk->inode->i_flags & FFS_INODE_COMPRESSED &&
+            walk->cluster_tail / FFS_CLUSTER_BLOCKS != walk->logical / FFS_CLUSTER_BLOCKS) {
+            walk->cluster_tail = walk->logical;
+        }
+        ffs_fsck_skip(walk, level);
+        return;
+    }
+    if (ffs_fsck_claim_block(walk, blockno) == EXIT_FAILURE) {
+        ffs_fsck_skip(walk, level);
+        return;
+    }
+
+    uint32_t pointers[FFS_ADDR_PER_BLOCK];
+    if (preadbuff(walk->fsck->fd, pointers, sizeof(pointers), (off_t) blockno * FFS_BLOCKSIZE) != sizeof(pointers)) {
+        ffs_fsck_problem(walk->fsck, "Cannot read indirect block %u of inode %lu", blockno, walk->inodei);
+        return;
+    }
+
+    for (uint64_t i = 0; i < FFS_ADDR_PER_BLOCK; ++i) {
+        if (walk->left == 0) {
+            if (pointers[i] != 0) {
+                ffs_fsck_problem(walk->fsck, "Inode %lu has block %u past the end of file", walk->inodei,
+                                 pointers[i]);
+            }
+        } else if (level == 1) {
+            ffs_fsck_data_block(walk, pointers[i]);
+        } else {
+            ffs_fsck_indirect(walk, level - 1, pointers[i]);
+        }
+    }
+}
+
+static void ffs_fsck_inode(ffs_fsck_t *fsck, uint64_t inodei, ffs_inode_t *inode) {
+    if (!S_ISDIR(inode->i_mode) && !S_ISREG(inode->i_mode) && !S_ISLNK(inode->i_mode)) {
+        ffs_fsck_problem(fsck, "Inode %lu has unsupported mode 0%o", inodei, inode->i_mode);
+        return;
+    }
+    // sizes past 2 GiB need large file support, only regular files can have them
+    uint64_t size = ffs_inode_size(inode);
+    if (!S_ISREG(inode->i_mode) && inode->i_size_high != 0) {
+        ffs_fsck_problem(fsck, "Inode %lu has upper size bits set, but is not a regular file", inodei);
+    }
+    if (size > INT32_MAX && !(fsck->sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_LARGE_FILE)) {
+        ffs_fsck_problem(fsck, "Inode %lu has size %lu, but filesystem does not support large files", inodei, size);
+        return;
+    }
+    if (S_ISDIR(inode->i_mode) && (size == 0 || size % FFS_BLOCKSIZE != 0)) {
+        ffs_fsck_problem(fsck, "Directory inode %lu has bad size %lu", inodei, size);
+    }
+
+    if (inode->i_flags & FFS_INODE_COMPRESSED) {
+        if (!(fsck->sb.sb_feature_incompat & FFS_FEATURE_INCOMPAT_COMPRESSION)) {
+            ffs_fsck_problem(fsck, "Inode %lu is compressed, but filesystem does not support it", inodei);
+        }
+        if (!S_ISREG(inode->i_mode) || (inode->i_flags & FFS_INODE_INLINE_DATA)) {
+            ffs_fsck_problem(fsck, "Inode %lu has compression flag set, but cannot be compressed", inodei);
+            return;
+        }
+    }
+
+    // inline contents take no blocks
+    if (inode->i_flags & FFS_INODE_INLINE_DATA) {
+        if (!(fsck->sb.sb_feature_incompat & FFS_FEATURE_INCOMPAT_INLINE_DATA)) {
+            ffs_fsck_problem(fsck, "Inode %lu has inline data, but filesystem does not support it", inodei);
+        }
+        if (S_ISDIR(inode->i_mode)) {
+            ffs_fsck_problem(fsck, "Directory inode %lu has inline data", inodei);
+        }
+        if (size > FFS_INLINE_DATA_MAX) {
+            ffs_fsck_problem(fsck, "Inode %lu has inline data of bad size %lu", inodei, size);
+        }
+        if (inode->i_blocks != 0) {
+            ffs_fsck_problem(fsck, "Inode %lu, i_blocks is %u, should be 0", inodei, inode->i_blocks);
+        }
+        return;
+    }
+
+    struct ffs_fsck_walk walk = {
+            .fsck = fsck,
+            .inodei = inodei,
+            .inode = inode,
+            .left = (size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE,
+            .logical = 0,
+            .counted = 0,
+            .cluster_tail = UINT64_MAX
+    };
+
+    for (uint8_t i = 0; i < FFS_DIRECT_BLOCKS; ++i) {
+        if (walk.left > 0) {
+            ffs_fsck_data_block(&walk, inode->i_block[i]);
+        } else if (inode->i_block[i] != 0) {
+            ffs_fsck_problem(fsck, "Inode %lu has block %u past the end of file", inodei, inode->i_block[i]);
+        }
+    }
+    for (uint8_t level = 1; level <= 3; ++level) {
+        uint32_t blockno = inode->i_block[FFS_DIRECT_BLOCKS + level - 1];
+        if (walk.left > 0) {
+            ffs_fsck_indirect(&walk, level, blockno);
+        } else if (blockno != 0) {
+            ffs_fsck_problem(fsck, "Inode %lu has block %u past the end of file", inodei, blockno);
+        }
+    }
+    if (walk.left > 0) {
+        ffs_fsck_problem(fsck, "Inode %lu is too big", inodei);
+    }
+
+    if (inode->i_blocks != walk.counted * (FFS_BLOCKSIZE / 512)) {
+        ffs_fsck_problem(fsck, "Inode %lu, i_blocks is %u, should be %lu", inodei, inode->i_blocks,
+                         walk.counted * (FFS_BLOCKSIZE / 512));
+    }
+}
+
+static void ffs_fsck_group(ffs_fsck_t *fsck, uint64_t gbn, uint8_t *meta) {
+    ffs_bgd_t *bgd = &fsck->bgdt[gbn];
+
+    // group metadata must be where mkfs.ffs put it
+    uint64_t bitmap = gbn == 0 ? 1 + fsck->bgdt_blocks : gbn * FFS_BLOCKS_PER_GROUP;
+    if (bgd->bgd_block_bitmap != bitmap || bgd->bgd_inode_bitmap != bitmap + 1 ||
+        bgd->bgd_inode_table != bitmap + 2) {
+        ffs_fsck_problem(fsck, "Group %lu descriptor points to wrong bitmaps or inode table", gbn);
+        return;
+    }
+    if (fsck->csum && bgd->bgd_checksum != ffs_bgd_checksum(gbn, bgd)) {
+        ffs_fsck_problem(fsck, "Group %lu descriptor checksum is invalid", gbn);
+    }
+
+    // bitmaps and inode table are read in one go
+    size_t size = (2 + FFS_INODE_TABLE_BLOCKS) * FFS_BLOCKSIZE;
+    if (preadbuff(fsck->fd, meta, size, (off_t) bitmap * FFS_BLOCKSIZE) != (ssize_t) size) {
+        ffs_fsck_problem(fsck, "Cannot read bitmaps and inode table of group %lu", gbn);
+        return;
+    }
+
+    for (uint64_t i = 0; i < 2 + FFS_INODE_TABLE_BLOCKS; ++i) {
+        ffs_bitset_test_and_set(&fsck->blocks, bitmap + i);
+    }
+    if (gbn == 0) {
+        // boot block with superblock and descriptors table
+        for (uint64_t i = 0; i < 1 + fsck->bgdt_blocks; ++i) {
+            ffs_bitset_test_and_set(&fsck->blocks, i);
+        }
+    }
+
+    uint8_t *inode_bitmap = meta + FFS_BLOCKSIZE;
+    ffs_inode_t *table = (ffs_inode_t *) (meta + 2 * FFS_BLOCKSIZE);
+
+    if (fsck->csum && bgd->bgd_block_bitmap_csum != ffs_bitmap_checksum(bitmap, meta)) {
+        ffs_fsck_problem(fsck, "Block bitmap checksum of group %lu does not match bitmap", gbn);
+    }
+    if (fsck->csum && bgd->bgd_inode_bitmap_csum != ffs_bitmap_checksum(bitmap + 1, inode_bitmap)) {
+        ffs_fsck_problem(fsck, "Inode bitmap checksum of group %lu does not match bitmap", gbn);
+    }
+
+    uint64_t free_inodes = 0, dirs = 0;
+    for (uint64_t i = 0; i < FFS_INODES_PER_GROUP; ++i) {
+        uint64_t inodei = gbn * FFS_INODES_PER_GROUP + i + 1;
+        ffs_inode_t *inode = &table[i];
+        uint8_t marked = bitmap_get_bit(inode_bitmap, i);
+
+        if (inodei <= FFS_RESERVED_INODES && inodei != FFS_ROOT_INODE) {
+            if (!marked) {
+                ffs_fsck_problem(fsck, "Reserved inode %lu is not marked in use", inodei);
+            }
+            continue;
+        }
+
+        uint8_t used = inode->i_links_count != 0;
+        if (used != marked) {
+            ffs_fsck_problem(fsck, "Inode %lu is %s but marked %s in bitmap", inodei, used ? "in use" : "free",
+                             marked ? "in use" : "free");
+        }
+        if (!marked) {
+            free_inodes++;
+        }
+        if (!used) {
+            continue;
+        }
+
+        if (S_ISDIR(inode->i_mode)) {
+            dirs++;
+        }
+        fsck->links[inodei].links_count = inode->i_links_count;
+        fsck->links[inodei].dir = S_ISDIR(inode->i_mode) != 0;
+        if (fsck->csum && ffs_inode_verify(inodei, inode) == EXIT_FAILURE) {
+            ffs_fsck_problem(fsck, "Inode %lu checksum does not match inode", inodei);
+        }
+        ffs_fsck_inode(fsck, inodei, inode);
+    }
+
+    if (gbn == 0 && (table[FFS_ROOT_INODE - 1].i_links_count == 0 || !S_ISDIR(table[FFS_ROOT_INODE - 1].i_mode))) {
+        ffs_fsck_problem(fsck, "Root inode is not a directory");
+    }
+    if (bgd->bgd_free_inodes_count != free_inodes) {
+        ffs_fsck_problem(fsck, "Free inodes count wrong for group %lu (%u, counted=%lu)", gbn,
+                         bgd->bgd_free_inodes_count, free_inodes);
+    }
+    if (bgd->bgd_used_dirs_count != dirs) {
+        ffs_fsck_problem(fsck, "Directories count wrong for group %lu (%u, counted=%lu)", gbn,
+                         bgd->bgd_used_dirs_count, dirs);
+    }
+}
+
+static void ffs_fsck_bitmaps(ffs_fsck_t *fsck, uint64_t gbn, uint8_t *bitmaps) {
+    ffs_bgd_t *bgd = &fsck->bgdt[gbn];
+
+    // block and inode bitmaps are adjacent
+    if (preadbuff(fsck->fd, bitmaps, 2 * FFS_BLOCKSIZE, (off_t) bgd->bgd_block_bitmap * FFS_BLOCKSIZE) !=
+        2 * FFS_BLOCKSIZE) {
+        ffs_fsck_problem(fsck, "Cannot read bitmaps of group %lu", gbn);
+        return;
+    }
+
+    uint64_t free_blocks = 0, used_blocks = 0, used_inodes = 0;
+    for (uint64_t i = 0; i < FFS_BLOCKS_PER_GROUP; ++i) {
+        uint64_t blockno = gbn * FFS_BLOCKS_PER_GROUP + i;
+        uint8_t marked = bitmap_get_bit(bitmaps, i);
+        uint8_t referenced = ffs_bitset_get(&fsck->blocks, blockno);
+
+        if (marked && !referenced) {
+            ffs_fsck_problem(fsck, "Block %lu is marked in use but not referenced", blockno);
+        } else if (!marked && referenced) {
+            ffs_fsck_problem(fsck, "Block %lu is in use but marked free", blockno);
+        }
+        if (marked) {
+            used_blocks++;
+        } else {
+            free_blocks++;
+        }
+    }
+
+    if (bgd->bgd_free_blocks_count != free_blocks) {
+        ffs_fsck_problem(fsck, "Free blocks count wrong for group %lu (%u, counted=%lu)", gbn,
+                         bgd->bgd_free_blocks_count, free_blocks);
+    }
+
+    uint8_t *inode_bitmap = bitmaps + FFS_BLOCKSIZE;
+    for (uint64_t i = 0; i < FFS_INODES_PER_GROUP; ++i) {
+        uint64_t inodei = gbn * FFS_INODES_PER_GROUP + i + 1;
+        if (inodei <= FFS_RESERVED_INODES && inodei != FFS_ROOT_INODE) {
+            continue;
+        }
+
+        uint8_t marked = bitmap_get_bit(inode_bitmap, i);
+        uint8_t referenced = ffs_bitset_get(&fsck->inodes, inodei);
+
+        if (!marked && referenced) {
+            ffs_fsck_problem(fsck, "Directory entry refers to unused inode %lu", inodei);
+        } else if (marked && !referenced && inodei != FFS_ROOT_INODE) {
+            ffs_fsck_problem(fsck, "Inode %lu is not referenced by any directory", inodei);
+        }
+        if (marked) {
+            used_inodes++;
+        }
+        if (marked && inodei == FFS_ROOT_INODE && referenced) {
+            ffs_fsck_problem(fsck, "Root inode is referenced by a directory entry");
+        }
+
+        ffs_fsck_links_t *links = &fsck->links[inodei];
+        if (!marked || links->links_count == 0) {
+            continue;
+        }
+        if (links->dir && ffs_bitset_get(&fsck->inodes_twice, inodei)) {
+            ffs_fsck_problem(fsck, "Directory inode %lu is referenced by more than one directory entry", inodei);
+        }
+
+        // a directory is named by its parent, its own '.' and '..' of each subdirectory
+        if (links->links_count != links->refs) {
+            ffs_fsck_problem(fsck, "Inode %lu ref count is %u, should be %u", inodei, links->links_count,
+                             links->refs);
+        }
+        uint32_t parent = inodei == FFS_ROOT_INODE ? FFS_ROOT_INODE : links->parent;
+        if (links->dir && parent != 0 && links->dotdot != parent) {
+            ffs_fsck_problem(fsck, "'..' in directory inode %lu is %u, should be %u", inodei, links->dotdot, parent);
+        }
+        // unnamed inodes are reported above, ones with several names may be reached through another one
+        if (referenced && links->reach != FFS_FSCK_REACHED && !ffs_bitset_get(&fsck->inodes_twice, inodei)) {
+            ffs_fsck_problem(fsck, "Inode %lu is not reachable from the root directory", inodei);
+        }
+    }
+
+    pthread_mutex_lock(&fsck->lock);
+    fsck->used_blocks += used_blocks;
+    fsck->used_inodes += used_inodes;
+    pthread_mutex_unlock(&fsck->lock);
+}
+
+struct ffs_fsck_pass {
+    ffs_fsck_t *fsck;
+    size_t buffer_size;
+    void (*check)(ffs_fsck_t *, uint64_t, uint8_t *);
+};
+
+static void *ffs_fsck_worker(void *arg) {
+    struct ffs_fsck_pass *pass = arg;
+    ffs_fsck_t *fsck = pass->fsck;
+
+    uint8_t *buffer;
+    if ((buffer = malloc(pass->buffer_size)) == NULL) {
+        perror("malloc");
+        exit(FFS_FSCK_FAILURE);
+    }
+
+    for (;;) {
+        // take next group
+        pthread_mutex_lock(&fsck->lock);
+        uint64_t gbn = fsck->next_group++;
+        pthread_mutex_unlock(&fsck->lock);
+
+        if (gbn >= fsck->bgn) {
+            break;
+        }
+        pass->check(fsck, gbn, buffer);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void ffs_fsck_run(ffs_fsck_t *fsck, uint64_t threads, struct ffs_fsck_pass *pass) {
+    fsck->next_group = 0;
+    if (threads > fsck->bgn) {
+        threads = fsck->bgn;
+    }
+
+    pthread_t *workers;
+    if ((workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        exit(FFS_FSCK_FAILURE);
+    }
+
+    for (uint64_t i = 0; i < threads; ++i) {
+        int error;
+        if ((error = pthread_create(&workers[i], NULL, ffs_fsck_worker, pass)) != 0) {
+            errno = error;
+            perror("pthread_create");
+            exit(FFS_FSCK_FAILURE);
+        }
+    }
+    for (uint64_t i = 0; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+}
+
+void ffs_fsck_check_groups(ffs_fsck_t *fsck, uint64_t threads) {
+    struct ffs_fsck_pass pass = {
+            .fsck = fsck,
+            .buffer_size = (2 + FFS_INODE_TABLE_BLOCKS) * FFS_BLOCKSIZE,
+            .check = ffs_fsck_group
+    };
+    ffs_fsck_run(fsck, threads, &pass);
+}
+
+// follows parents of a directory up to the root, directories on the way get the same answer and a loop
+// of directories is unreachable
+static uint8_t ffs_fsck_reach(ffs_fsck_t *fsck, uint64_t inodei) {
+    ffs_fsck_links_t *links = fsck->links;
+
+    uint64_t i = inodei;
+    while (links[i].reach == FFS_FSCK_UNKNOWN) {
+        links[i].reach = FFS_FSCK_VISITING;
+        uint64_t parent = links[i].parent;
+        if (parent == 0 || !links[parent].dir) {
+            i = 0;
+            break;
+        }
+        i = parent;
+    }
+
+    uint8_t reach = i != 0 && links[i].reach == FFS_FSCK_REACHED ? FFS_FSCK_REACHED : FFS_FSCK_UNREACHED;
+    for (i = inodei; links[i].reach == FFS_FSCK_VISITING; i = links[i].parent) {
+        links[i].reach = reach;
+    }
+    return reach;
+}
+
+void ffs_fsck_check_bitmaps(ffs_fsck_t *fsck, uint64_t threads) {
+    // parents are known for every inode by now, connectivity is resolved before groups are checked
+    fsck->links[FFS_ROOT_INODE].reach = FFS_FSCK_REACHED;
+    for (uint64_t i = 1; i <= fsck->sb.sb_inodes_count; ++i) {
+        ffs_fsck_links_t *links = &fsck->links[i];
+        if (links->links_count == 0 || links->reach != FFS_FSCK_UNKNOWN) {
+            continue;
+        }
+        if (links->dir) {
+            ffs_fsck_reach(fsck, i);
+        } else {
+            links->reach = links->parent != 0 && fsck->links[links->parent].dir
+                           ? ffs_fsck_reach(fsck, links->parent) : FFS_FSCK_UNREACHED;
+        }
+    }
+
+    struct ffs_fsck_pass pass = {
+            .fsck = fsck,
+            .buffer_size = 2 * FFS_BLOCKSIZE,
+            .check = ffs_fsck_bitmaps
+    };
+    ffs_fsck_run(fsck, threads, &pass);
+}
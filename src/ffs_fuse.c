@@ -7,259 +7,135 @@
 #include <stdlib.h>
 #include <string.h>
 
-int ffs_statfs(const char *path, struct statvfs *statv) {
-    // open file
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "rb")) == NULL) {
-        return -EXIT_FAILURE;
+// inode of an opened file or directory is kept in its handle, other calls look the path up
+static int ffs_lookup(const char *path, struct fuse_file_info *fi, uint64_t *inum) {
+    if (fi != NULL && fi->fh != 0) {
+        *inum = fi->fh;
+        return EXIT_SUCCESS;
     }
+    return ffs_fs_lookup(FFS_DATA->fs, path, inum);
+}
 
-    // read superblock
-    ffs_sb_t sb;
-    if (read_superblock(fs, &sb) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+int ffs_statfs(const char *path, struct statvfs *statv) {
+    if (ffs_fs_statfs(FFS_DATA->fs, statv) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    fclose(fs);
-
-    statv->f_bsize = 1024 << sb.sb_log_block_size;
-    statv->f_blocks = sb.sb_blocks_count;
-    statv->f_bfree = sb.sb_free_blocks_count;
-    statv->f_bavail = sb.sb_free_blocks_count;
-    statv->f_files = sb.sb_inodes_count;
-    statv->f_ffree = sb.sb_free_inodes_count;
-    statv->f_namemax = FFS_FILENAME_MAX_LENGTH;
-
     return EXIT_SUCCESS;
 }
 
 int ffs_opendir(const char *path, struct fuse_file_info *fi) {
+    // directory is looked up once, readdir calls continue from its inode
+    uint64_t inum;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE) {
+        return -errno;
+    }
+    fi->fh = inum;
+
     return EXIT_SUCCESS;
 }
 
 int ffs_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t inum;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE) {
+        return -errno;
+    }
+    fi->fh = inum;
+
     return EXIT_SUCCESS;
 }
 
-int ffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    // open file
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "rb")) == NULL) {
-        return -EXIT_FAILURE;
-    }
-
-    // find inode number
-    uint64_t inum;
-    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
+struct ffs_fill {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
 
-    // read inode
-    ffs_inode_t inode;
-    if (read_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
+static int ffs_fill_entry(void *arg, const char *name, uint64_t inodei, uint64_t cookie) {
+    struct ffs_fill *fill = arg;
+    // full buffer is not an error, next call resumes at this entry
+    return fill->filler(fill->buf, name, NULL, cookie);
+}
 
-    // number of blocks used by inode
-    uint64_t blocks = inode.i_size / sizeof(ffs_block_t);
-    if (blocks > 12) {
-        blocks = 12;
+int ffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    uint64_t inum;
+    if (ffs_lookup(path, fi, &inum) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    for (size_t block = 0; block < blocks; ++block) {
-        // move file pointer to record length of the first directory entry on the block
-        if (fseek(fs, sizeof(ffs_block_t) * inode.i_block[block] + 4, SEEK_SET) == -1) {
-            fclose(fs);
-            return -EXIT_FAILURE;
-        }
-
-        uint16_t rl;
-        do {
-            // read entry length
-            if (fread(&rl, 2, 1, fs) != 1) {
-                fclose(fs);
-                return -EXIT_FAILURE;
-            }
-            if (rl != 0) {
-                // read entry name length
-                uint16_t namelen;
-                if (fread(&namelen, 2, 1, fs) != 1) {
-                    fclose(fs);
-                    return -EXIT_FAILURE;
-                }
-                // allocate memory for entry name
-                char name[248];
-                // read entry name
-                if (fread(name, namelen, 1, fs) != 1) {
-                    fclose(fs);
-                    return -EXIT_FAILURE;
-                }
-                name[namelen] = '\0';
-                if (filler(buf, name, NULL, 0) != 0) {
-                    fclose(fs);
-                    return -EXIT_FAILURE;
-                }
-                // move file pointer to next entry's record length
-                if (fseek(fs, rl - namelen - 4, SEEK_CUR) == -1) {
-                    fclose(fs);
-                    return -EXIT_FAILURE;
-                }
-            }
-        } while (rl != 0);
+    // offset is a cookie of logical block and record position following the last returned entry
+    struct ffs_fill fill = {.buf = buf, .filler = filler};
+    if (ffs_fs_readdir(FFS_DATA->fs, inum, offset, ffs_fill_entry, &fill) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    fclose(fs);
-
     return EXIT_SUCCESS;
 }
 
 int ffs_getattr(const char *path, struct stat *statbuf) {
-    // open file
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "rb")) == NULL) {
-        return -EXIT_FAILURE;
-    }
-
-    // find inode number
     uint64_t inum;
-    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
-
-    // read inode
-    ffs_inode_t inode;
-    if (read_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE ||
+        ffs_fs_stat(FFS_DATA->fs, inum, statbuf) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    fclose(fs);
-
-    memset(statbuf, 0, sizeof(struct stat));
-
-    statbuf->st_mode = inode.i_mode;
-    statbuf->st_ino = inum;
-    statbuf->st_nlink = inode.i_links_count;
-    statbuf->st_uid = inode.i_uid;
-    statbuf->st_gid = inode.i_gid;
-    statbuf->st_size = inode.i_size;
-    statbuf->st_blksize = inode.i_blocks;
     return EXIT_SUCCESS;
 }
 
 int ffs_chmod(const char *path, mode_t mode) {
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "r+b")) == NULL) {
-        return -EXIT_FAILURE;
-    }
-
-    // find inode number
     uint64_t inum;
-    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
-
-    // read inode
-    ffs_inode_t inode;
-    if (read_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
-
-    inode.i_mode = mode;
-
-    if (write_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE ||
+        ffs_fs_chmod(FFS_DATA->fs, inum, mode) == EXIT_FAILURE) {
+        return -errno;
     }
 
     return EXIT_SUCCESS;
 }
 
 int ffs_chown(const char *path, uid_t uid, gid_t gid) {
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "r+b")) == NULL) {
-        return -EXIT_FAILURE;
-    }
-
-    // find inode number
     uint64_t inum;
-    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
-
-    // read inode
-    ffs_inode_t inode;
-    if (read_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
-
-    inode.i_gid = gid;
-    inode.i_uid = uid;
-
-    if (write_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE ||
+        ffs_fs_chown(FFS_DATA->fs, inum, uid, gid) == EXIT_FAILURE) {
+        return -errno;
     }
 
     return EXIT_SUCCESS;
 }
 
 int ffs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    FILE *fs;
-    if ((fs = fopen(FFS_DATA->source, "r")) == NULL) {
-        return -EXIT_FAILURE;
-    }
-
-    // find inode number
     uint64_t inum;
-    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+    if (ffs_lookup(path, fi, &inum) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    // read inode
-    ffs_inode_t inode;
-    if (read_inode(fs, inum, &inode) == EXIT_FAILURE) {
-        fclose(fs);
-        return -EXIT_FAILURE;
-    }
+    int64_t done = ffs_fs_read(FFS_DATA->fs, inum, buf, size, offset);
 
-    // number of blocks used by inode
-    uint64_t blocks = inode.i_size / sizeof(ffs_block_t);
-    if (blocks > 12) {
-        blocks = 12;
-    }
+    return done < 0 ? -errno : done;
+}
 
-    // allocate memory
-    if ((buf = calloc(sizeof(char), size)) == NULL) {
-        fclose(fs);
-        return -EXIT_FAILURE;
+int ffs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    // space is never preallocated, only punching holes into existing files is supported
+    if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
     }
 
-    for (size_t block = 0; block < blocks; ++block) {
-        // move file pointer to a block
-        if (fseek(fs, sizeof(ffs_block_t) * inode.i_block[block], SEEK_SET) == -1) {
-            fclose(fs);
-            free(buf);
-            return -EXIT_FAILURE;
-        }
-        // read all chars from the block
-        if (fread(buf + block * 2048, 1, 2048, fs) != 2048) {
-            fclose(fs);
-            free(buf);
-            return -EXIT_FAILURE;
-        }
+    uint64_t inum;
+    if (ffs_lookup(path, fi, &inum) == EXIT_FAILURE ||
+        ffs_fs_punch_hole(FFS_DATA->fs, inum, offset, length) == EXIT_FAILURE) {
+        return -errno;
     }
 
-    fclose(fs);
+    return EXIT_SUCCESS;
+}
+
+int ffs_readlink(const char *path, char *buf, size_t size) {
+    uint64_t inum;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE ||
+        ffs_fs_readlink(FFS_DATA->fs, inum, buf, size) == EXIT_FAILURE) {
+        return -errno;
+    }
 
     return EXIT_SUCCESS;
 }
@@ -273,12 +149,96 @@ int ffs_utimens(const char *path, const struct timespec tv[2]) {
 }
 
 int ffs_getxattr(const char *path, const char *name, char *value, size_t size) {
-    return -ENOTSUP;
+    // cache and warm-up counters are published as a read-only attribute of the root, files have no attributes
+    uint64_t inum;
+    if (ffs_fs_lookup(FFS_DATA->fs, path, &inum) == EXIT_FAILURE) {
+        return -errno;
+    }
+    if (inum != FFS_ROOT_INODE || strcmp(name, FFS_STATS_XATTR) != 0) {
+        return -ENODATA;
+    }
+
+    ffs_fs_stats_t stats;
+    ffs_fs_stats(FFS_DATA->fs, &stats);
+
+    char text[512];
+    int len = snprintf(text, sizeof(text),
+                       "meta_hits %lu\nmeta_misses %lu\ncluster_hits %lu\ncluster_misses %lu\n"
+                       "warmup %s\nwarmup_tasks %lu/%lu\nwarmup_blocks %lu\n",
+                       stats.meta_hits, stats.meta_misses, stats.cluster_hits, stats.cluster_misses,
+                       stats.warmup_running ? "running" : stats.warmup_tasks > 0 ? "done" : "off",
+                       stats.warmup_tasks_done, stats.warmup_tasks, stats.warmup_blocks);
+
+    // size 0 asks for the length only
+    if (size == 0) {
+        return len;
+    }
+    if (size < (size_t) len) {
+        return -ERANGE;
+    }
+    memcpy(value, text, len);
+    return len;
+}
+
+// reads inode numbers saved by the previous mount, a missing list is not an error
+static uint64_t ffs_load_hot_list(const char *filename, uint64_t *inodes, uint64_t max) {
+    FILE *file;
+    if ((file = fopen(filename, "r")) == NULL) {
+        return 0;
+    }
+
+    uint64_t count = 0;
+    while (count < max && fscanf(file, "%lu", &inodes[count]) == 1) {
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static void ffs_save_hot_list(const char *filename, uint64_t *inodes, uint64_t count) {
+    FILE *file;
+    if ((file = fopen(filename, "w")) == NULL) {
+        perror(filename);
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        fprintf(file, "%lu\n", inodes[i]);
+    }
+    if (fclose(file) == EOF) {
+        perror(filename);
+    }
 }
 
 void *ffs_init(struct fuse_conn_info *conn) {
-    return FFS_DATA;
+    struct ffs_init_data *ffs_data = FFS_DATA;
+    if (ffs_data->warmup_threads == 0) {
+        return ffs_data;
+    }
+
+    // warm-up runs in the background, requests are served from the start
+    uint64_t *hot = NULL, count = 0;
+    if (ffs_data->hot_list != NULL && (hot = malloc(FFS_HOT_LIST_MAX * sizeof(uint64_t))) != NULL) {
+        count = ffs_load_hot_list(ffs_data->hot_list, hot, FFS_HOT_LIST_MAX);
+    }
+    if (ffs_fs_warmup_start(ffs_data->fs, ffs_data->warmup_threads, hot, count) == EXIT_FAILURE) {
+        perror("warm-up");
+    }
+    free(hot);
+
+    return ffs_data;
 }
 
 void ffs_destroy(void *userdata) {
+    struct ffs_init_data *ffs_data = userdata;
+    ffs_fs_warmup_stop(ffs_data->fs);
+
+    // what is cached now is what the next mount loads first
+    uint64_t *hot;
+    if (ffs_data->hot_list != NULL && (hot = malloc(FFS_HOT_LIST_MAX * sizeof(uint64_t))) != NULL) {
+        ffs_save_hot_list(ffs_data->hot_list, hot, ffs_fs_hot_inodes(ffs_data->fs, hot, FFS_HOT_LIST_MAX));
+        free(hot);
+    }
+
+    ffs_fs_close(ffs_data->fs);
 }
@@ -0,0 +1,165 @@
+#include "ffs_lz.h"
+
+#include <string.h>
+
+#define FFS_LZ_HASH_LOG 12
+#define FFS_LZ_MIN_MATCH 4
+#define FFS_LZ_MAX_OFFSET 65535
+// last match has to start this far from the end, and the tail is always literals
+#define FFS_LZ_MATCH_LIMIT 12
+#define FFS_LZ_LAST_LITERALS 5
+
+static uint32_t ffs_lz_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t ffs_lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - FFS_LZ_HASH_LOG);
+}
+
+// writes length continuation bytes after a saturated token nibble
+static uint8_t *ffs_lz_put_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+static uint8_t *ffs_lz_put_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t literal_len,
+                                    size_t offset, size_t match_len) {
+    // worst case size of the sequence
+    size_t need = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+    if ((size_t) (end - op) < need) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (literal_len < 15 ? literal_len : 15) << 4;
+    if (literal_len >= 15) {
+        op = ffs_lz_put_length(op, literal_len - 15);
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    // the last sequence has no match
+    if (offset == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= FFS_LZ_MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15) {
+        op = ffs_lz_put_length(op, match_len - 15);
+    }
+
+    return op;
+}
+
+size_t ffs_lz_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << FFS_LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    uint8_t *op = dst, *end = dst + capacity;
+    size_t ip = 0, anchor = 0;
+
+    if (size > FFS_LZ_MATCH_LIMIT) {
+        size_t limit = size - FFS_LZ_MATCH_LIMIT;
+        while (ip < limit) {
+            uint32_t sequence = ffs_lz_read32(src + ip);
+            uint32_t h = ffs_lz_hash(sequence);
+            size_t ref = table[h];
+            table[h] = ip;
+
+            if (ref >= ip || ip - ref > FFS_LZ_MAX_OFFSET || ffs_lz_read32(src + ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t match_len = FFS_LZ_MIN_MATCH;
+            while (ip + match_len < size - FFS_LZ_LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            if ((op = ffs_lz_put_sequence(op, end, src + anchor, ip - anchor, ip - ref, match_len)) == NULL) {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    if ((op = ffs_lz_put_sequence(op, end, src + anchor, size - anchor, 0, 0)) == NULL) {
+        return 0;
+    }
+
+    return op - dst;
+}
+
+// reads length continuation bytes, returns 0 on truncated input
+static uint8_t ffs_lz_get_length(const uint8_t *src, size_t size, size_t *ip, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= size) {
+            return 0;
+        }
+        byte = src[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+ssize_t ffs_lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    size_t ip = 0, op = 0;
+
+    while (ip < size) {
+        uint8_t token = src[ip++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !ffs_lz_get_length(src, size, &ip, &literal_len)) {
+            return -1;
+        }
+        if (literal_len > size - ip || literal_len > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        // block ends with literals
+        if (ip == size) {
+            break;
+        }
+
+        if (size - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !ffs_lz_get_length(src, size, &ip, &match_len)) {
+            return -1;
+        }
+        match_len += FFS_LZ_MIN_MATCH;
+        if (match_len > capacity - op) {
+            return -1;
+        }
+
+        // matches may overlap their own output
+        for (size_t i = 0; i < match_len; ++i) {
+            dst[op + i] = dst[op - offset + i];
+        }
+        op += match_len;
+    }
+
+    return op;
+}
@@ -1,9 +1,12 @@
 #include "ffs_common.h"
 #include "ffs_fuse.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 struct fuse_operations ffs_op = {
@@ -15,6 +18,8 @@ struct fuse_operations ffs_op = {
         .chmod      = ffs_chmod,
         .chown      = ffs_chown,
         .read       = ffs_read,
+        .fallocate  = ffs_fallocate,
+        .readlink   = ffs_readlink,
         .access     = ffs_access,
         .utimens    = ffs_utimens,
         .getxattr   = ffs_getxattr,
@@ -22,19 +27,78 @@ struct fuse_operations ffs_op = {
         .destroy    = ffs_destroy
 };
 
+// hot list may not exist yet, it is made absolute because the daemon leaves the working directory
+static char *ffs_absolute_path(const char *path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+
+    char cwd[PATH_MAX];
+    char *absolute;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || (absolute = malloc(strlen(cwd) + strlen(path) + 2)) == NULL) {
+        return NULL;
+    }
+    sprintf(absolute, "%s/%s", cwd, path);
+    return absolute;
+}
+
 int main(int argc, char *argv[], char *envp[]) {
-    if ((argc < 3) || (argv[argc - 2][0] == '-') || (argv[argc - 1][0] == '-')) {
-        fprintf(stderr, "usage:\tffs [FUSE and mount options] [source] [destination]\n");
+    struct ffs_init_data *ffs_data = (struct ffs_init_data *) calloc(1, sizeof(struct ffs_init_data));
+    if (ffs_data == NULL) {
         return EXIT_FAILURE;
     }
 
-    struct ffs_init_data *ffs_data = (struct ffs_init_data *) malloc(sizeof(struct ffs_init_data));
-    if (ffs_data == NULL) {
+    // own options come before FUSE ones and are removed from arguments
+    int skip = 0;
+    while (1 + skip + 1 < argc && (strcmp(argv[1 + skip], "-W") == 0 || strcmp(argv[1 + skip], "-H") == 0)) {
+        if (argv[1 + skip][1] == 'W') {
+            ffs_data->warmup_threads = strtoul(argv[2 + skip], NULL, 10);
+        } else if ((ffs_data->hot_list = ffs_absolute_path(argv[2 + skip])) == NULL) {
+            perror(argv[2 + skip]);
+            return EXIT_FAILURE;
+        }
+        skip += 2;
+    }
+    for (int i = 1; i + skip <= argc; ++i) {
+        argv[i] = argv[i + skip];
+    }
+    argc -= skip;
+
+    if ((argc < 3) || (argv[argc - 2][0] == '-') || (argv[argc - 1][0] == '-')) {
+        fprintf(stderr, "usage:\tffs [-W threads] [-H hot list] [FUSE and mount options] [source] [destination]\n");
         return EXIT_FAILURE;
     }
 
+    // hot list alone warms up with a thread per processor
+    if (ffs_data->hot_list != NULL && ffs_data->warmup_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ffs_data->warmup_threads = cpus < 1 ? 1 : cpus;
+    }
+
     // remove mount source from options
     ffs_data->source = realpath(argv[argc - 2], NULL);
+    if (ffs_data->source == NULL) {
+        perror(argv[argc - 2]);
+        return EXIT_FAILURE;
+    }
+
+    // image stays open for the lifetime of the mount, read-only files can still be mounted
+    if ((ffs_data->fs = ffs_fs_open(ffs_data->source, O_RDWR)) == NULL &&
+        (errno == EACCES || errno == EROFS || errno == EPERM)) {
+        ffs_data->fs = ffs_fs_open(ffs_data->source, O_RDONLY);
+    }
+    // refuse images using on-disk format this build does not understand
+    if (ffs_data->fs == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "%s: not an ffs image\n", argv[argc - 2]);
+        } else if (errno == EOPNOTSUPP) {
+            fprintf(stderr, "%s: unsupported filesystem features\n", argv[argc - 2]);
+        } else {
+            perror(argv[argc - 2]);
+        }
+        return EXIT_FAILURE;
+    }
+
     argv[argc - 2] = argv[argc - 1];
     argv[argc - 1] = NULL;
     argc--;
@@ -1,22 +1,56 @@
 #include "ffs_common.h"
+#include "ffs_csum.h"
 #include "ffs_mkfs.h"
+#include "ffs_populate.h"
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 int main(int argc, char *argv[], char *envp[]) {
     printf("mkfs.ffs 1.0.0 (27-Dec-2019)\n\n");
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: mkfs.ffs [filename]\n");
+    char *source = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t feature_incompat = FFS_FEATURE_INCOMPAT_PACKED_DIRS | FFS_FEATURE_INCOMPAT_INLINE_DATA;
+    uint32_t feature_ro_compat = FFS_FEATURE_RO_COMPAT_METADATA_CSUM;
+    uint8_t sparse = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "cd:j:l")) != -1) {
+        switch (opt) {
+            case 'c':
+                // compress files copied with -d
+                feature_incompat |= FFS_FEATURE_INCOMPAT_COMPRESSION;
+                break;
+            case 'd':
+                source = optarg;
+                break;
+            case 'l':
+                // fixed-size directory records, no inline data, checksums or holes, readable by old ffs
+                feature_incompat &= ~(FFS_FEATURE_INCOMPAT_PACKED_DIRS | FFS_FEATURE_INCOMPAT_INLINE_DATA);
+                feature_ro_compat &= ~FFS_FEATURE_RO_COMPAT_METADATA_CSUM;
+                sparse = 0;
+                break;
+            case 'j':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: mkfs.ffs [-c] [-l] [-d directory] [-j threads] [filename]\n");
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: mkfs.ffs [-c] [-l] [-d directory] [-j threads] [filename]\n");
         return EXIT_FAILURE;
     }
 
     struct stat stats;
-    if (lstat(argv[1], &stats) == -1) {
+    if (lstat(argv[optind], &stats) == -1) {
         perror("stat");
         return EXIT_FAILURE;
     }
@@ -32,7 +66,7 @@ int main(int argc, char *argv[], char *envp[]) {
     }
 
     int fd;
-    if ((fd = open(argv[1], O_WRONLY)) < 0) {
+    if ((fd = open(argv[optind], O_WRONLY)) < 0) {
         perror("open");
         return EXIT_FAILURE;
     }
@@ -40,139 +74,427 @@ int main(int argc, char *argv[], char *envp[]) {
     uint64_t bgn = stats.st_size / (FFS_BLOCKSIZE * FFS_BLOCKS_PER_GROUP);
     uint64_t bgdt_blocks = ((bgn % 64) == 0) ? bgn / 64 : (bgn / 64) + 1;
 
-    printf("Creating filesystem with %d 2KB blocks and %d inodes\n\n", bgn * FFS_BLOCKS_PER_GROUP, bgn * FFS_INODES_PER_GROUP);
+    printf("Creating filesystem with %lu 2KB blocks and %lu inodes\n\n", bgn * FFS_BLOCKS_PER_GROUP,
+           bgn * FFS_INODES_PER_GROUP);
 
-    ffs_write_superblock(fd, bgn, bgdt_blocks);
-    ffs_write_bgd_table(fd, bgn, bgdt_blocks);
-    ffs_write_block_groups(fd, bgn, bgdt_blocks);
+    ffs_layout_t layout;
+    ffs_init_layout(&layout, bgn, bgdt_blocks);
+    layout.feature_incompat = feature_incompat;
+    layout.feature_ro_compat = feature_ro_compat;
+    layout.sparse = sparse;
 
+    // file data goes first, metadata describing it is written afterwards
+    if (source == NULL) {
+        ffs_write_root_directory(fd, &layout);
+    } else {
+        ffs_populate(fd, &layout, source, threads < 1 ? 1 : threads);
+    }
+
+    ffs_write_block_groups(fd, &layout);
+    ffs_write_bgd_table(fd, &layout);
+    ffs_write_superblock(fd, &layout);
+
+    ffs_free_layout(&layout);
     close(fd);
 
     return EXIT_SUCCESS;
 }
 
-void ffs_write_superblock(int fd, uint64_t bgn, uint64_t bgdt_blocks) {
-    static ffs_sb_t sb;
-    sb.sb_inodes_count = bgn * FFS_INODES_PER_GROUP;
-    sb.sb_blocks_count = bgn * FFS_BLOCKS_PER_GROUP;
-    sb.sb_free_blocks_count = bgn * (FFS_BLOCKS_PER_GROUP - 2 - FFS_INODE_TABLE_BLOCKS) - 2 - bgdt_blocks;
-    sb.sb_free_inodes_count = sb.sb_inodes_count - FFS_RESERVED_INODES;
-    sb.sb_log_block_size = FFS_LOG_BLOCK_SIZE;
-    sb.sb_log_frag_size = FFS_LOG_BLOCK_SIZE;
-    sb.sb_blocks_per_group = FFS_BLOCKS_PER_GROUP;
-    sb.sb_frags_per_group = FFS_BLOCKS_PER_GROUP;
-    sb.sb_inodes_per_group = FFS_INODES_PER_GROUP;
-    sb.sb_max_mnt_count = 0xffff;
-    sb.sb_magic = FFS_MAGIC;
-    sb.sb_state = FFS_FILESYSTEM_STATE;
-    sb.sb_errors = FFS_ERROR_HANDLER;
-    sb.sb_minor_rev_level = 0;
-    sb.sb_checkinterval = 0xffffffff;
-    sb.sb_rev_level = 0;
+// first block after bitmaps and inode table of the group
+static uint64_t ffs_group_data_start(ffs_layout_t *layout, uint64_t group) {
+    return group == 0 ? 3 + layout->bgdt_blocks + FFS_INODE_TABLE_BLOCKS
+                      : group * FFS_BLOCKS_PER_GROUP + 2 + FFS_INODE_TABLE_BLOCKS;
+}
 
-    if (lseek(fd, 1024, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
+void ffs_init_layout(ffs_layout_t *layout, uint64_t bgn, uint64_t bgdt_blocks) {
+    memset(layout, 0, sizeof(ffs_layout_t));
+    layout->bgn = bgn;
+    layout->bgdt_blocks = bgdt_blocks;
+    layout->next_inode = FFS_RESERVED_INODES + 1;
+
+    if (ffs_group_data_start(layout, 0) >= FFS_BLOCKS_PER_GROUP) {
+        fprintf(stderr, "Too many block groups: descriptors do not fit into the first group\n");
         exit(EXIT_FAILURE);
     }
 
-    if (writebuff(fd, &sb, sizeof(sb)) == -1) {
-        perror("write");
-        close(fd);
+    layout->bgdt = calloc(bgn, sizeof(ffs_bgd_t));
+    layout->block_bitmaps = calloc(bgn, FFS_BLOCKSIZE);
+    layout->inode_bitmaps = calloc(bgn, FFS_BLOCKSIZE);
+    layout->inode_tables = calloc(bgn, sizeof(ffs_inode_t *));
+    if (layout->bgdt == NULL || layout->block_bitmaps == NULL || layout->inode_bitmaps == NULL ||
+        layout->inode_tables == NULL) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
 
-    printf("Writing superblock and filesystem accounting information: done\n");
+    for (uint64_t i = 0; i < bgn; ++i) {
+        ffs_bgd_t *bgd = &layout->bgdt[i];
+        bgd->bgd_block_bitmap = i == 0 ? 1 + bgdt_blocks : i * FFS_BLOCKS_PER_GROUP;
+        bgd->bgd_inode_bitmap = bgd->bgd_block_bitmap + 1;
+        bgd->bgd_inode_table = bgd->bgd_inode_bitmap + 1;
+
+        // boot block, descriptors table, bitmaps and inode table are in use
+        uint64_t used = ffs_group_data_start(layout, i) - i * FFS_BLOCKS_PER_GROUP;
+        for (uint64_t j = 0; j < used; ++j) {
+            bitmap_set_bit(layout->block_bitmaps + i * FFS_BLOCKSIZE, j, 1);
+        }
+        bgd->bgd_free_blocks_count = FFS_BLOCKS_PER_GROUP - used;
+        bgd->bgd_free_inodes_count = FFS_INODES_PER_GROUP;
+        layout->data_blocks += FFS_BLOCKS_PER_GROUP - used;
+    }
+
+    for (uint8_t j = 0; j < FFS_RESERVED_INODES; ++j) {
+        bitmap_set_bit(layout->inode_bitmaps, j, 1);
+    }
+    layout->bgdt[0].bgd_free_inodes_count -= FFS_RESERVED_INODES;
+    layout->bgdt[0].bgd_used_dirs_count = 1;
 }
 
-void ffs_write_bgd_table(int fd, uint64_t bgn, uint64_t bgdt_blocks) {
-    if (lseek(fd, FFS_BLOCKSIZE, SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
-        exit(EXIT_FAILURE);
+void ffs_free_layout(ffs_layout_t *layout) {
+    for (uint64_t i = 0; i < layout->bgn; ++i) {
+        free(layout->inode_tables[i]);
     }
+    free(layout->inode_tables);
+    free(layout->inode_bitmaps);
+    free(layout->block_bitmaps);
+    free(layout->bgdt);
+}
 
-    for (uint64_t i = 0; i < bgn; ++i) {
-        static ffs_bgd_t bgd;
-        bgd.bgd_block_bitmap = i == 0 ? 1 + bgdt_blocks : i * FFS_BLOCKS_PER_GROUP;
-        bgd.bgd_inode_bitmap = bgd.bgd_block_bitmap + 1;
-        bgd.bgd_inode_table = bgd.bgd_inode_bitmap + 1;
-        bgd.bgd_free_blocks_count = i == 0 ? FFS_BLOCKS_PER_GROUP - 4 - FFS_INODE_TABLE_BLOCKS - bgdt_blocks : FFS_BLOCKS_PER_GROUP - 2 - FFS_INODE_TABLE_BLOCKS;
-        bgd.bgd_free_inodes_count = i == 0 ? FFS_INODES_PER_GROUP - FFS_RESERVED_INODES : FFS_INODES_PER_GROUP;
-        bgd.bgd_used_dirs_count = i == 0 ? 1 : 0;
-
-        if (writebuff(fd, &bgd, sizeof(bgd)) == -1) {
-            perror("write");
-            close(fd);
+ffs_inode_t *ffs_layout_inode(ffs_layout_t *layout, uint64_t inodei) {
+    // inodes are counted from 1
+    uint64_t gbn = (inodei - 1) / FFS_INODES_PER_GROUP;
+
+    // inode tables are allocated only for groups that have inodes in use
+    if (layout->inode_tables[gbn] == NULL) {
+        if ((layout->inode_tables[gbn] = calloc(FFS_INODES_PER_GROUP, sizeof(ffs_inode_t))) == NULL) {
+            perror("calloc");
             exit(EXIT_FAILURE);
         }
     }
 
-    printf("Writing block group descriptors table: done\n");
+    return &layout->inode_tables[gbn][(inodei - 1) % FFS_INODES_PER_GROUP];
 }
 
-void ffs_write_block_groups(int fd, uint64_t bgn, uint64_t bgdt_blocks) {
-    if (lseek(fd, FFS_BLOCKSIZE * (bgdt_blocks + 1), SEEK_SET) == -1) {
-        perror("lseek");
-        close(fd);
+uint64_t ffs_alloc_inode(ffs_layout_t *layout, uint8_t dir) {
+    if (layout->next_inode > layout->bgn * FFS_INODES_PER_GROUP) {
+        fprintf(stderr, "Not enough free inodes\n");
         exit(EXIT_FAILURE);
     }
 
-    static ffs_inode_t root_inode;
-    root_inode.i_mode = 0x41ed;
-    root_inode.i_size = FFS_BLOCKSIZE;
-    root_inode.i_links_count = 2;
-    root_inode.i_blocks = FFS_BLOCKSIZE / 512;
-    root_inode.i_block[0] = 3 + bgdt_blocks + FFS_INODE_TABLE_BLOCKS;
+    uint64_t inodei = layout->next_inode++;
+    uint64_t gbn = (inodei - 1) / FFS_INODES_PER_GROUP;
 
-    for (uint64_t i = 0; i < bgn; ++i) {
-        static ffs_bg_t bg;
-        for (uint8_t j = 0; j < 2 + FFS_INODE_TABLE_BLOCKS; ++j) {
-            bitmap_set_bit(bg.bg_block_bitmap, j, 1);
+    bitmap_set_bit(layout->inode_bitmaps + gbn * FFS_BLOCKSIZE, (inodei - 1) % FFS_INODES_PER_GROUP, 1);
+    layout->bgdt[gbn].bgd_free_inodes_count--;
+    if (dir) {
+        layout->bgdt[gbn].bgd_used_dirs_count++;
+    }
+
+    return inodei;
+}
+
+uint64_t ffs_alloc_blocks(ffs_layout_t *layout, uint64_t count) {
+    if (layout->next_data + count > layout->data_blocks) {
+        fprintf(stderr, "Not enough free blocks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t first = layout->next_data;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t blockno = ffs_data_block(layout, layout->next_data++);
+        uint64_t gbn = blockno / FFS_BLOCKS_PER_GROUP;
+        bitmap_set_bit(layout->block_bitmaps + gbn * FFS_BLOCKSIZE, blockno % FFS_BLOCKS_PER_GROUP, 1);
+        layout->bgdt[gbn].bgd_free_blocks_count--;
+    }
+
+    return first;
+}
+
+uint32_t ffs_data_block(ffs_layout_t *layout, uint64_t ordinal) {
+    // data blocks are numbered consecutively, skipping metadata at the start of every group
+    uint64_t first_group = FFS_BLOCKS_PER_GROUP - ffs_group_data_start(layout, 0);
+    if (ordinal < first_group) {
+        return ffs_group_data_start(layout, 0) + ordinal;
+    }
+    ordinal -= first_group;
+
+    uint64_t per_group = FFS_BLOCKS_PER_GROUP - 2 - FFS_INODE_TABLE_BLOCKS;
+    return ffs_group_data_start(layout, 1 + ordinal / per_group) + ordinal % per_group;
+}
+
+struct ffs_map_state {
+    ffs_layout_t *layout;
+    uint64_t first;
+    uint64_t next_meta;
+    uint64_t next_data;
+    uint64_t left;
+    uint64_t block;
+    uint8_t *meta;
+    uint8_t *clusters;
+};
+
+// blocks past the stored part of a cluster are left unmapped
+static uint32_t ffs_map_data(struct ffs_map_state *state) {
+    uint64_t block = state->block++;
+    state->left--;
+    if (state->clusters != NULL &&
+        block % FFS_CLUSTER_BLOCKS >= state->clusters[block / FFS_CLUSTER_BLOCKS]) {
+        return 0;
+    }
+    return ffs_data_block(state->layout, state->next_data++);
+}
+
+// whether any of the next count blocks is stored
+static uint8_t ffs_map_stored(struct ffs_map_state *state, uint64_t count) {
+    if (state->clusters == NULL) {
+        return 1;
+    }
+    for (uint64_t cluster = state->block / FFS_CLUSTER_BLOCKS;
+         cluster * FFS_CLUSTER_BLOCKS < state->block + count; ++cluster) {
+        uint64_t start = cluster * FFS_CLUSTER_BLOCKS;
+        if (state->clusters[cluster] > 0 && start + state->clusters[cluster] > state->block) {
+            return 1;
         }
+    }
+    return 0;
+}
 
-        if (i == 0) {
-            for (uint64_t j = 0; j < bgdt_blocks + 2; ++j) {
-                bitmap_set_bit(bg.bg_block_bitmap, 2 + FFS_INODE_TABLE_BLOCKS + j, 1);
-            }
-            for (uint8_t j = 0; j < FFS_RESERVED_INODES; ++j) {
-                bitmap_set_bit(bg.bg_inode_bitmap, j, 1);
-            }
-            bg.bg_inode_table[1] = root_inode;
+static uint32_t ffs_map_indirect(struct ffs_map_state *state, uint8_t level) {
+    // trees addressing nothing stored are holes themselves
+    uint64_t span = 1;
+    for (uint8_t i = 0; i < level; ++i) {
+        span *= FFS_ADDR_PER_BLOCK;
+    }
+    span = span < state->left ? span : state->left;
+    if (state->layout->sparse && !ffs_map_stored(state, span)) {
+        state->block += span;
+        state->left -= span;
+        return 0;
+    }
+
+    uint64_t ordinal = state->next_meta++;
+    uint32_t *pointers = state->meta == NULL ? NULL
+                                             : (uint32_t *) (state->meta + (ordinal - state->first) * FFS_BLOCKSIZE);
+
+    for (uint64_t i = 0; i < FFS_ADDR_PER_BLOCK && state->left > 0; ++i) {
+        uint32_t child;
+        if (level == 1) {
+            child = ffs_map_data(state);
+        } else {
+            child = ffs_map_indirect(state, level - 1);
         }
+        if (pointers != NULL) {
+            pointers[i] = child;
+        }
+    }
+
+    return ffs_data_block(state->layout, ordinal);
+}
+
+static void ffs_map_tree(struct ffs_map_state *state, uint32_t *i_block) {
+    memset(i_block, 0, sizeof(uint32_t) * 15);
+    for (uint8_t i = 0; i < FFS_DIRECT_BLOCKS && state->left > 0; ++i) {
+        i_block[i] = ffs_map_data(state);
+    }
+    for (uint8_t level = 1; level <= 3 && state->left > 0; ++level) {
+        i_block[FFS_DIRECT_BLOCKS + level - 1] = ffs_map_indirect(state, level);
+    }
+}
+
+uint64_t ffs_map_meta_blocks(ffs_layout_t *layout, uint64_t blocks, uint8_t *clusters) {
+    if (clusters == NULL || !layout->sparse) {
+        return ffs_meta_blocks(blocks);
+    }
+
+    // dry run counting indirect blocks, nothing is written
+    struct ffs_map_state state = {
+            .layout = layout,
+            .left = blocks,
+            .clusters = clusters
+    };
+    uint32_t i_block[15];
+    ffs_map_tree(&state, i_block);
+    return state.next_meta;
+}
+
+void ffs_map_blocks(ffs_layout_t *layout, uint64_t first, uint64_t blocks, uint32_t *i_block, uint8_t *meta,
+                    uint8_t *clusters) {
+    // indirect blocks are placed right before the data they address
+    struct ffs_map_state state = {
+            .layout = layout,
+            .first = first,
+            .next_meta = first,
+            .next_data = first + ffs_map_meta_blocks(layout, blocks, clusters),
+            .left = blocks,
+            .block = 0,
+            .meta = meta,
+            .clusters = clusters
+    };
+    ffs_map_tree(&state, i_block);
+}
 
-        if (writebuff(fd, &bg, sizeof(bg)) == -1) {
+uint16_t ffs_dir_block_end(ffs_layout_t *layout) {
+    if (layout->feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        return FFS_BLOCKSIZE - sizeof(ffs_dt_t);
+    }
+    return FFS_BLOCKSIZE;
+}
+
+void ffs_seal_dir_blocks(ffs_layout_t *layout, uint64_t first, void *buffer, uint64_t count) {
+    if (!(layout->feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM)) {
+        return;
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        ffs_dir_block_seal(ffs_data_block(layout, first + i), (ffs_block_t *) buffer + i);
+    }
+}
+
+uint16_t ffs_dir_rec_len(ffs_layout_t *layout, uint16_t name_len) {
+    if (layout->feature_incompat & FFS_FEATURE_INCOMPAT_PACKED_DIRS) {
+        return FFS_DIR_PACKED_RECORD_LENGTH(name_len);
+    }
+    return FFS_DIR_ENTRY_RECORD_LENGTH;
+}
+
+void ffs_write_ordinals(int fd, ffs_layout_t *layout, uint64_t first, void *buffer, uint64_t count) {
+    while (count > 0) {
+        // find physically contiguous run
+        uint32_t blockno = ffs_data_block(layout, first);
+        uint64_t run = 1;
+        while (run < count && ffs_data_block(layout, first + run) == blockno + run) {
+            run++;
+        }
+
+        if (pwritebuff(fd, buffer, run * FFS_BLOCKSIZE, (off_t) blockno * FFS_BLOCKSIZE) == -1) {
             perror("write");
             close(fd);
             exit(EXIT_FAILURE);
         }
+
+        buffer = (uint8_t *) buffer + run * FFS_BLOCKSIZE;
+        first += run;
+        count -= run;
     }
+}
+
+void ffs_write_root_directory(int fd, ffs_layout_t *layout) {
+    ffs_inode_t *root_inode = ffs_layout_inode(layout, FFS_ROOT_INODE);
+    root_inode->i_mode = 0x41ed;
+    root_inode->i_size = FFS_BLOCKSIZE;
+    root_inode->i_links_count = 2;
+    root_inode->i_blocks = FFS_BLOCKSIZE / 512;
+
+    uint64_t first = ffs_alloc_blocks(layout, 1);
+    ffs_map_blocks(layout, first, 1, root_inode->i_block, NULL, NULL);
+
+    static ffs_block_t block;
+    ffs_de_t *root_de = (ffs_de_t *) block.b_data;
+    root_de->de_inode = FFS_ROOT_INODE;
+    root_de->de_rec_len = ffs_dir_rec_len(layout, 1);
+    root_de->de_name_len = 1;
+    root_de->de_name[0] = '.';
 
-    ffs_de_t root_de[2];
-    root_de[0].de_inode = 2;
-    root_de[0].de_rec_len = FFS_DIR_ENTRY_RECORD_LENGTH;
-    root_de[0].de_name_len = 1;
-    root_de[0].de_name[0] = '.';
-    root_de[0].de_name[1] = 0;
+    root_de = (ffs_de_t *) (block.b_data + root_de->de_rec_len);
+    root_de->de_inode = FFS_ROOT_INODE;
+    root_de->de_rec_len = ffs_dir_rec_len(layout, 2);
+    root_de->de_name_len = 2;
+    root_de->de_name[0] = '.';
+    root_de->de_name[1] = '.';
 
-    root_de[1].de_inode = 2;
-    root_de[1].de_rec_len = FFS_DIR_ENTRY_RECORD_LENGTH;
-    root_de[1].de_name_len = 2;
-    root_de[1].de_name[0] = '.';
-    root_de[1].de_name[1] = '.';
-    root_de[1].de_name[2] = 0;
+    ffs_seal_dir_blocks(layout, first, &block, 1);
+    ffs_write_ordinals(fd, layout, first, &block, 1);
 
-    if (lseek(fd, FFS_BLOCKSIZE * root_inode.i_block[0], SEEK_SET) == -1) {
-        perror("lseek");
+    printf("Writing root directory: done\n");
+}
+
+void ffs_write_superblock(int fd, ffs_layout_t *layout) {
+    static ffs_sb_t sb;
+    sb.sb_inodes_count = layout->bgn * FFS_INODES_PER_GROUP;
+    sb.sb_blocks_count = layout->bgn * FFS_BLOCKS_PER_GROUP;
+    sb.sb_free_blocks_count = 0;
+    sb.sb_free_inodes_count = 0;
+    for (uint64_t i = 0; i < layout->bgn; ++i) {
+        sb.sb_free_blocks_count += layout->bgdt[i].bgd_free_blocks_count;
+        sb.sb_free_inodes_count += layout->bgdt[i].bgd_free_inodes_count;
+    }
+    sb.sb_log_block_size = FFS_LOG_BLOCK_SIZE;
+    sb.sb_log_frag_size = FFS_LOG_BLOCK_SIZE;
+    sb.sb_blocks_per_group = FFS_BLOCKS_PER_GROUP;
+    sb.sb_frags_per_group = FFS_BLOCKS_PER_GROUP;
+    sb.sb_inodes_per_group = FFS_INODES_PER_GROUP;
+    sb.sb_max_mnt_count = 0xffff;
+    sb.sb_magic = FFS_MAGIC;
+    sb.sb_state = FFS_FILESYSTEM_STATE;
+    sb.sb_errors = FFS_ERROR_HANDLER;
+    sb.sb_minor_rev_level = 0;
+    sb.sb_checkinterval = 0xffffffff;
+    sb.sb_rev_level = 0;
+    sb.sb_feature_incompat = layout->feature_incompat;
+    sb.sb_feature_ro_compat = layout->feature_ro_compat;
+    if (layout->feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        sb.sb_checksum = ffs_sb_checksum(&sb);
+    }
+
+    if (pwritebuff(fd, &sb, sizeof(sb), 1024) == -1) {
+        perror("write");
         close(fd);
         exit(EXIT_FAILURE);
     }
 
-    if (writebuff(fd, &root_de, sizeof(root_de)) == -1) {
+    printf("Writing superblock and filesystem accounting information: done\n");
+}
+
+void ffs_write_bgd_table(int fd, ffs_layout_t *layout) {
+    // bitmaps are final by now
+    if (layout->feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+        for (uint64_t i = 0; i < layout->bgn; ++i) {
+            ffs_bgd_t *bgd = &layout->bgdt[i];
+            bgd->bgd_block_bitmap_csum = ffs_bitmap_checksum(bgd->bgd_block_bitmap,
+                                                             layout->block_bitmaps + i * FFS_BLOCKSIZE);
+            bgd->bgd_inode_bitmap_csum = ffs_bitmap_checksum(bgd->bgd_inode_bitmap,
+                                                             layout->inode_bitmaps + i * FFS_BLOCKSIZE);
+            bgd->bgd_checksum = ffs_bgd_checksum(i, bgd);
+        }
+    }
+
+    // whole table goes out in a single write
+    if (pwritebuff(fd, layout->bgdt, layout->bgn * sizeof(ffs_bgd_t), FFS_BLOCKSIZE) == -1) {
         perror("write");
         close(fd);
         exit(EXIT_FAILURE);
     }
 
+    printf("Writing block group descriptors table: done\n");
+}
+
+void ffs_write_block_groups(int fd, ffs_layout_t *layout) {
+    // bitmaps and inode table are adjacent, so every group is written at once
+    static uint8_t meta[(2 + FFS_INODE_TABLE_BLOCKS) * FFS_BLOCKSIZE];
+
+    for (uint64_t i = 0; i < layout->bgn; ++i) {
+        memcpy(meta, layout->block_bitmaps + i * FFS_BLOCKSIZE, FFS_BLOCKSIZE);
+        memcpy(meta + FFS_BLOCKSIZE, layout->inode_bitmaps + i * FFS_BLOCKSIZE, FFS_BLOCKSIZE);
+        if (layout->inode_tables[i] != NULL) {
+            memcpy(meta + 2 * FFS_BLOCKSIZE, layout->inode_tables[i], FFS_INODE_TABLE_BLOCKS * FFS_BLOCKSIZE);
+            if (layout->feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) {
+                ffs_inode_t *table = (ffs_inode_t *) (meta + 2 * FFS_BLOCKSIZE);
+                for (uint64_t j = 0; j < FFS_INODES_PER_GROUP; ++j) {
+                    // unused inodes stay zero
+                    if (table[j].i_mode != 0) {
+                        table[j].i_checksum = ffs_inode_checksum(i * FFS_INODES_PER_GROUP + j + 1, &table[j]);
+                    }
+                }
+            }
+        } else {
+            memset(meta + 2 * FFS_BLOCKSIZE, 0, FFS_INODE_TABLE_BLOCKS * FFS_BLOCKSIZE);
+        }
+
+        if (pwritebuff(fd, meta, sizeof(meta), (off_t) layout->bgdt[i].bgd_block_bitmap * FFS_BLOCKSIZE) == -1) {
+            perror("write");
+            close(fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     printf("Writing block groups: done\n\n");
 }
@@ -0,0 +1,642 @@
+#include "ffs_common.h"
+#include "ffs_lz.h"
+#include "ffs_populate.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t ffs_add_node(ffs_tree_t *tree, const char *path, uint64_t parent) {
+    if (tree->count == tree->capacity) {
+        tree->capacity = tree->capacity == 0 ? 1024 : tree->capacity * 2;
+        if ((tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(ffs_node_t))) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ffs_node_t *node = &tree->nodes[tree->count];
+    memset(node, 0, sizeof(ffs_node_t));
+    if ((node->path = strdup(path)) == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    char *slash = strrchr(node->path, '/');
+    node->name = slash == NULL ? node->path : slash + 1;
+    node->parent = parent;
+
+    if (lstat(path, &node->st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    return tree->count++;
+}
+
+static int ffs_skip_dots(const struct dirent *entry) {
+    return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+void ffs_scan_tree(ffs_tree_t *tree, const char *source) {
+    memset(tree, 0, sizeof(ffs_tree_t));
+    ffs_add_node(tree, source, 0);
+
+    if (!S_ISDIR(tree->nodes[0].st.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", source);
+        exit(EXIT_FAILURE);
+    }
+
+    // breadth-first walk keeps children of a directory next to each other
+    for (uint64_t i = 0; i < tree->count; ++i) {
+        if (!S_ISDIR(tree->nodes[i].st.st_mode)) {
+            continue;
+        }
+
+        struct dirent **entries;
+        int n;
+        if ((n = scandir(tree->nodes[i].path, &entries, ffs_skip_dots, alphasort)) == -1) {
+            perror(tree->nodes[i].path);
+            exit(EXIT_FAILURE);
+        }
+
+        tree->nodes[i].first_child = tree->count;
+        for (int j = 0; j < n; ++j) {
+            if (strlen(entries[j]->d_name) > FFS_FILENAME_MAX_LENGTH) {
+                fprintf(stderr, "%s/%s: file name too long\n", tree->nodes[i].path, entries[j]->d_name);
+                exit(EXIT_FAILURE);
+            }
+
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", tree->nodes[i].path, entries[j]->d_name) >= PATH_MAX) {
+                fprintf(stderr, "%s/%s: path too long\n", tree->nodes[i].path, entries[j]->d_name);
+                exit(EXIT_FAILURE);
+            }
+            free(entries[j]);
+
+            uint64_t child = ffs_add_node(tree, path, i);
+            mode_t mode = tree->nodes[child].st.st_mode;
+            if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+                fprintf(stderr, "%s: unsupported file type, skipping\n", path);
+                free(tree->nodes[child].path);
+                tree->count--;
+                continue;
+            }
+            if (S_ISDIR(mode)) {
+                tree->nodes[i].subdirs++;
+            }
+            tree->nodes[i].children++;
+        }
+        free(entries);
+    }
+}
+
+void ffs_free_tree(ffs_tree_t *tree) {
+    for (uint64_t i = 0; i < tree->count; ++i) {
+        free(tree->nodes[i].clusters);
+        free(tree->nodes[i].path);
+    }
+    free(tree->nodes);
+}
+
+static void ffs_fill_inode(ffs_inode_t *inode, ffs_node_t *node, uint64_t size) {
+    inode->i_mode = node->st.st_mode;
+    inode->i_uid = node->st.st_uid & 0xffff;
+    inode->i_uid_high = node->st.st_uid >> 16;
+    inode->i_gid = node->st.st_gid & 0xffff;
+    inode->i_gid_high = node->st.st_gid >> 16;
+    ffs_inode_set_size(inode, size);
+    inode->i_atime = node->st.st_atime;
+    inode->i_ctime = node->st.st_ctime;
+    inode->i_mtime = node->st.st_mtime;
+    inode->i_links_count = S_ISDIR(node->st.st_mode) ? 2 + node->subdirs : 1;
+    inode->i_blocks = (node->meta + node->stored) * (FFS_BLOCKSIZE / 512);
+}
+
+// places directory entry at pos or at the start of the next block if it does not fit, returns position after it
+static uint64_t ffs_put_dir_entry(ffs_layout_t *layout, uint8_t *data, uint64_t pos, uint32_t inodei,
+                                  const char *name) {
+    uint16_t name_len = strlen(name);
+    uint16_t rec_len = ffs_dir_rec_len(layout, name_len);
+    if (pos % FFS_BLOCKSIZE + rec_len > ffs_dir_block_end(layout)) {
+        pos += FFS_BLOCKSIZE - pos % FFS_BLOCKSIZE;
+    }
+
+    if (data != NULL) {
+        ffs_de_t *de = (ffs_de_t *) (data + pos);
+        de->de_inode = inodei;
+        de->de_rec_len = rec_len;
+        de->de_name_len = name_len;
+        memcpy(de->de_name, name, name_len);
+    }
+
+    return pos + rec_len;
+}
+
+// lays out all entries of a directory, only measures it when data is NULL
+static uint64_t ffs_put_dir_entries(ffs_layout_t *layout, ffs_tree_t *tree, ffs_node_t *node, uint8_t *data) {
+    uint64_t pos = ffs_put_dir_entry(layout, data, 0, node->inodei, ".");
+    pos = ffs_put_dir_entry(layout, data, pos, tree->nodes[node->parent].inodei, "..");
+    for (uint64_t j = 0; j < node->children; ++j) {
+        ffs_node_t *child = &tree->nodes[node->first_child + j];
+        pos = ffs_put_dir_entry(layout, data, pos, child->inodei, child->name);
+    }
+    return pos;
+}
+
+static void ffs_write_directories(int fd, ffs_layout_t *layout, ffs_tree_t *tree) {
+    // all directories are packed together in front of file data
+    for (uint64_t i = 0; i < tree->count; ++i) {
+        ffs_node_t *node = &tree->nodes[i];
+        if (!S_ISDIR(node->st.st_mode)) {
+            continue;
+        }
+
+        node->blocks = (ffs_put_dir_entries(layout, tree, node, NULL) + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+        node->stored = node->blocks;
+        node->meta = ffs_meta_blocks(node->blocks);
+
+        uint64_t meta = node->meta;
+        node->first = ffs_alloc_blocks(layout, meta + node->blocks);
+
+        uint8_t *buffer;
+        if ((buffer = calloc(meta + node->blocks, FFS_BLOCKSIZE)) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        ffs_inode_t *inode = ffs_layout_inode(layout, node->inodei);
+        ffs_fill_inode(inode, node, node->blocks * FFS_BLOCKSIZE);
+        ffs_map_blocks(layout, node->first, node->blocks, inode->i_block, buffer, NULL);
+        ffs_put_dir_entries(layout, tree, node, buffer + meta * FFS_BLOCKSIZE);
+        ffs_seal_dir_blocks(layout, node->first + meta, buffer + meta * FFS_BLOCKSIZE, node->blocks);
+
+        ffs_write_ordinals(fd, layout, node->first, buffer, meta + node->blocks);
+        free(buffer);
+    }
+
+    printf("Writing directories: done\n");
+}
+
+static void ffs_inline_file(ffs_node_t *node, ffs_inode_t *inode) {
+    int src;
+    if ((src = open(node->path, O_RDONLY)) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+
+    // contents go straight into the inode, no data blocks are used
+    ffs_fill_inode(inode, node, node->st.st_size);
+    inode->i_flags |= FFS_INODE_INLINE_DATA;
+    if (preadbuff(src, inode->i_data, node->st.st_size, 0) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+
+    close(src);
+}
+
+static void ffs_write_symlink(int fd, ffs_layout_t *layout, ffs_node_t *node, ffs_inode_t *inode) {
+    char target[PATH_MAX];
+    ssize_t len;
+    if ((len = readlink(node->path, target, sizeof(target))) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+
+    // short targets are kept inline
+    if ((layout->feature_incompat & FFS_FEATURE_INCOMPAT_INLINE_DATA) && len <= FFS_INLINE_DATA_MAX) {
+        ffs_fill_inode(inode, node, len);
+        inode->i_flags |= FFS_INODE_INLINE_DATA;
+        memcpy(inode->i_data, target, len);
+        return;
+    }
+
+    node->blocks = (len + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+    node->stored = node->blocks;
+    node->first = ffs_alloc_blocks(layout, node->blocks);
+    ffs_fill_inode(inode, node, len);
+    ffs_map_blocks(layout, node->first, node->blocks, inode->i_block, NULL, NULL);
+
+    uint8_t *buffer;
+    if ((buffer = calloc(node->blocks, FFS_BLOCKSIZE)) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(buffer, target, len);
+    ffs_write_ordinals(fd, layout, node->first, buffer, node->blocks);
+    free(buffer);
+}
+
+struct ffs_copy {
+    int fd;
+    ffs_layout_t *layout;
+    ffs_tree_t *tree;
+    uint64_t next;
+    uint8_t measure;
+    // one spill file per worker of the measuring pass
+    FILE **spills;
+    uint64_t workers;
+    pthread_mutex_t lock;
+};
+
+// compresses a cluster into out, returns the number of blocks it takes on disk
+static uint8_t ffs_pack_cluster(uint8_t *data, size_t size, uint8_t *out) {
+    uint64_t blocks = (size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+
+    // clusters of zeros are not stored at all
+    uint64_t zero = 0;
+    while (zero < blocks * FFS_BLOCKSIZE && data[zero] == 0) {
+        zero++;
+    }
+    if (zero == blocks * FFS_BLOCKSIZE) {
+        return 0;
+    }
+
+    // compression has to save at least one block
+    uint32_t len = 0;
+    if (blocks > 1) {
+        len = ffs_lz_compress(data, size, out + FFS_CLUSTER_HEADER_LENGTH,
+                              (blocks - 1) * FFS_BLOCKSIZE - FFS_CLUSTER_HEADER_LENGTH);
+    }
+    if (len == 0) {
+        memcpy(out, data, blocks * FFS_BLOCKSIZE);
+        return blocks;
+    }
+
+    memcpy(out, &len, FFS_CLUSTER_HEADER_LENGTH);
+    uint64_t packed = (FFS_CLUSTER_HEADER_LENGTH + len + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+    memset(out + FFS_CLUSTER_HEADER_LENGTH + len, 0, packed * FFS_BLOCKSIZE - FFS_CLUSTER_HEADER_LENGTH - len);
+    return packed;
+}
+
+// compresses a file cluster by cluster, the packed clusters are appended to the worker's spill file
+static void ffs_pack_file(ffs_node_t *node, uint8_t *buffer, uint8_t *packed, int spill, uint64_t *spilled) {
+    int src;
+    if ((src = open(node->path, O_RDONLY)) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    node->spill = spill;
+    node->spill_offset = *spilled;
+    for (uint64_t block = 0; block < node->blocks; block += FFS_COPY_CHUNK_BLOCKS) {
+        uint64_t count = node->blocks - block < FFS_COPY_CHUNK_BLOCKS ? node->blocks - block : FFS_COPY_CHUNK_BLOCKS;
+
+        // only clusters holding data are read, neighbouring ones together
+        for (uint64_t i = 0; i < count;) {
+            uint64_t run = 0;
+            while (i + run < count && node->clusters[(block + i + run) / FFS_CLUSTER_BLOCKS] != 0) {
+                run += node->clusters[(block + i + run) / FFS_CLUSTER_BLOCKS];
+            }
+            if (run == 0) {
+                i += FFS_CLUSTER_BLOCKS;
+                continue;
+            }
+
+            ssize_t got;
+            if ((got = preadbuff(src, buffer + i * FFS_BLOCKSIZE, run * FFS_BLOCKSIZE,
+                                 (off_t) (block + i) * FFS_BLOCKSIZE)) == -1) {
+                perror(node->path);
+                exit(EXIT_FAILURE);
+            }
+            // pad the tail of the last block, or the whole run if the file has shrunk since scan
+            memset(buffer + i * FFS_BLOCKSIZE + got, 0, run * FFS_BLOCKSIZE - got);
+            i += run;
+        }
+
+        // pack every cluster of the chunk one after another, holes take no blocks like clusters of zeros
+        uint64_t stored = 0;
+        for (uint64_t i = 0; i < count; i += FFS_CLUSTER_BLOCKS) {
+            if (node->clusters[(block + i) / FFS_CLUSTER_BLOCKS] == 0) {
+                continue;
+            }
+            uint64_t offset = (block + i) * FFS_BLOCKSIZE;
+            size_t size = node->st.st_size - offset < FFS_CLUSTER_SIZE ? node->st.st_size - offset : FFS_CLUSTER_SIZE;
+
+            uint8_t blocks = ffs_pack_cluster(buffer + i * FFS_BLOCKSIZE, size, packed + stored * FFS_BLOCKSIZE);
+            node->clusters[(block + i) / FFS_CLUSTER_BLOCKS] = blocks;
+            stored += blocks;
+        }
+
+        if (pwritebuff(spill, packed, stored * FFS_BLOCKSIZE, (off_t) *spilled) == -1) {
+            perror("spill");
+            exit(EXIT_FAILURE);
+        }
+        *spilled += stored * FFS_BLOCKSIZE;
+    }
+
+    close(src);
+}
+
+static void ffs_copy_file(struct ffs_copy *copy, ffs_node_t *node, uint8_t *buffer) {
+    // indirect blocks precede the data
+    uint64_t meta = node->meta;
+    if (meta > 0) {
+        uint8_t *meta_buffer;
+        if ((meta_buffer = calloc(meta, FFS_BLOCKSIZE)) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t i_block[15];
+        ffs_map_blocks(copy->layout, node->first, node->blocks, i_block, meta_buffer, node->clusters);
+        ffs_write_ordinals(copy->fd, copy->layout, node->first, meta_buffer, meta);
+        free(meta_buffer);
+    }
+
+    // compressed files were packed while being measured, their clusters come from the spill file
+    uint64_t ordinal = node->first + meta;
+    if (node->compressed) {
+        for (uint64_t block = 0; block < node->stored; block += FFS_COPY_CHUNK_BLOCKS) {
+            uint64_t count =
+                    node->stored - block < FFS_COPY_CHUNK_BLOCKS ? node->stored - block : FFS_COPY_CHUNK_BLOCKS;
+            if (preadbuff(node->spill, buffer, count * FFS_BLOCKSIZE,
+                          (off_t) (node->spill_offset + block * FFS_BLOCKSIZE)) != (ssize_t) (count * FFS_BLOCKSIZE)) {
+                perror("spill");
+                exit(EXIT_FAILURE);
+            }
+            ffs_write_ordinals(copy->fd, copy->layout, ordinal + block, buffer, count);
+        }
+        return;
+    }
+
+    int src;
+    if ((src = open(node->path, O_RDONLY)) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (uint64_t block = 0; block < node->blocks; block += FFS_COPY_CHUNK_BLOCKS) {
+        uint64_t count = node->blocks - block < FFS_COPY_CHUNK_BLOCKS ? node->blocks - block : FFS_COPY_CHUNK_BLOCKS;
+
+        // holes are neither read nor written, neighbouring stored clusters are copied together
+        if (node->clusters != NULL) {
+            for (uint64_t i = 0; i < count;) {
+                uint64_t run = 0;
+                while (i + run < count && node->clusters[(block + i + run) / FFS_CLUSTER_BLOCKS] != 0) {
+                    run += node->clusters[(block + i + run) / FFS_CLUSTER_BLOCKS];
+                }
+                if (run == 0) {
+                    i += FFS_CLUSTER_BLOCKS;
+                    continue;
+                }
+
+                ssize_t got;
+                if ((got = preadbuff(src, buffer, run * FFS_BLOCKSIZE, (off_t) (block + i) * FFS_BLOCKSIZE)) == -1) {
+                    perror(node->path);
+                    exit(EXIT_FAILURE);
+                }
+                memset(buffer + got, 0, run * FFS_BLOCKSIZE - got);
+                ffs_write_ordinals(copy->fd, copy->layout, ordinal, buffer, run);
+                ordinal += run;
+                i += run;
+            }
+            continue;
+        }
+
+        ssize_t got;
+        if ((got = preadbuff(src, buffer, count * FFS_BLOCKSIZE, (off_t) block * FFS_BLOCKSIZE)) == -1) {
+            perror(node->path);
+            exit(EXIT_FAILURE);
+        }
+        // pad the tail of the last block, or the whole chunk if the file has shrunk since scan
+        memset(buffer + got, 0, count * FFS_BLOCKSIZE - got);
+        ffs_write_ordinals(copy->fd, copy->layout, ordinal, buffer, count);
+        ordinal += count;
+    }
+
+    close(src);
+}
+
+static void *ffs_copy_worker(void *arg) {
+    struct ffs_copy *copy = arg;
+
+    uint8_t *buffer, *packed;
+    if ((buffer = malloc(FFS_COPY_CHUNK_BLOCKS * FFS_BLOCKSIZE)) == NULL ||
+        (packed = malloc(FFS_COPY_CHUNK_BLOCKS * FFS_BLOCKSIZE)) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&copy->lock);
+    int spill = copy->measure ? fileno(copy->spills[copy->workers++]) : -1;
+    pthread_mutex_unlock(&copy->lock);
+    uint64_t spilled = 0;
+
+    for (;;) {
+        // take next regular file, only compressed ones are measured
+        pthread_mutex_lock(&copy->lock);
+        while (copy->next < copy->tree->count && (!S_ISREG(copy->tree->nodes[copy->next].st.st_mode) ||
+                                                  (copy->measure && !copy->tree->nodes[copy->next].compressed))) {
+            copy->next++;
+        }
+        uint64_t i = copy->next++;
+        pthread_mutex_unlock(&copy->lock);
+
+        if (i >= copy->tree->count) {
+            break;
+        }
+        if (copy->tree->nodes[i].blocks == 0) {
+            continue;
+        }
+        if (copy->measure) {
+            ffs_pack_file(&copy->tree->nodes[i], buffer, packed, spill, &spilled);
+        } else {
+            ffs_copy_file(copy, &copy->tree->nodes[i], buffer);
+        }
+    }
+
+    free(packed);
+    free(buffer);
+    return NULL;
+}
+
+static void ffs_copy_files(int fd, ffs_layout_t *layout, ffs_tree_t *tree, uint64_t threads, uint8_t measure,
+                           FILE **spills) {
+    struct ffs_copy copy = {
+            .fd = fd,
+            .layout = layout,
+            .tree = tree,
+            .next = 0,
+            .measure = measure,
+            .spills = spills,
+            .workers = 0,
+            .lock = PTHREAD_MUTEX_INITIALIZER
+    };
+
+    pthread_t *workers;
+    if ((workers = calloc(threads, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint64_t i = 0; i < threads; ++i) {
+        int error;
+        if ((error = pthread_create(&workers[i], NULL, ffs_copy_worker, &copy)) != 0) {
+            errno = error;
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (uint64_t i = 0; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+
+    printf(measure ? "Compressing files: done\n" : "Copying files: done\n");
+}
+
+// marks clusters holding any data of the file, the rest are holes, lseek finds data without reading holes
+static void ffs_find_holes(ffs_node_t *node) {
+    int src;
+    if ((src = open(node->path, O_RDONLY)) == -1) {
+        perror(node->path);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t clusters = (node->blocks + FFS_CLUSTER_BLOCKS - 1) / FFS_CLUSTER_BLOCKS;
+    if ((node->clusters = calloc(clusters, 1)) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t data = 0, hole;
+    while ((data = lseek(src, data, SEEK_DATA)) != -1 && data < node->st.st_size) {
+        if ((hole = lseek(src, data, SEEK_HOLE)) == -1 || hole > node->st.st_size) {
+            hole = node->st.st_size;
+        }
+        for (uint64_t i = data / FFS_CLUSTER_SIZE; i < clusters && i * FFS_CLUSTER_SIZE < (uint64_t) hole; ++i) {
+            uint64_t left = node->blocks - i * FFS_CLUSTER_BLOCKS;
+            node->clusters[i] = left < FFS_CLUSTER_BLOCKS ? left : FFS_CLUSTER_BLOCKS;
+        }
+        data = hole;
+    }
+    // without hole support the whole file is data
+    if (data == -1 && errno != ENXIO) {
+        for (uint64_t i = 0; i < clusters; ++i) {
+            uint64_t left = node->blocks - i * FFS_CLUSTER_BLOCKS;
+            node->clusters[i] = left < FFS_CLUSTER_BLOCKS ? left : FFS_CLUSTER_BLOCKS;
+        }
+    }
+
+    close(src);
+
+    // dense files keep the plain layout, compressed ones need the marks to skip holes while packing
+    if (!node->compressed && memchr(node->clusters, 0, clusters) == NULL) {
+        free(node->clusters);
+        node->clusters = NULL;
+    }
+}
+
+void ffs_populate(int fd, ffs_layout_t *layout, const char *source, uint64_t threads) {
+    ffs_tree_t tree;
+    ffs_scan_tree(&tree, source);
+
+    // root directory has fixed inode number, the rest are assigned in walk order
+    tree.nodes[0].inodei = FFS_ROOT_INODE;
+    for (uint64_t i = 1; i < tree.count; ++i) {
+        tree.nodes[i].inodei = ffs_alloc_inode(layout, S_ISDIR(tree.nodes[i].st.st_mode));
+    }
+
+    ffs_write_directories(fd, layout, &tree);
+
+    uint8_t compress = 0;
+    for (uint64_t i = 1; i < tree.count; ++i) {
+        ffs_node_t *node = &tree.nodes[i];
+        if (S_ISDIR(node->st.st_mode)) {
+            continue;
+        }
+        if ((uint64_t) node->st.st_size > FFS_MAX_FILE_BLOCKS * FFS_BLOCKSIZE) {
+            fprintf(stderr, "%s: file too large\n", node->path);
+            exit(EXIT_FAILURE);
+        }
+        if (node->st.st_size > INT32_MAX) {
+            layout->feature_ro_compat |= FFS_FEATURE_RO_COMPAT_LARGE_FILE;
+        }
+
+        ffs_inode_t *inode = ffs_layout_inode(layout, node->inodei);
+        if (S_ISLNK(node->st.st_mode)) {
+            ffs_write_symlink(fd, layout, node, inode);
+            continue;
+        }
+        if ((layout->feature_incompat & FFS_FEATURE_INCOMPAT_INLINE_DATA) && node->st.st_size > 0 &&
+            node->st.st_size <= FFS_INLINE_DATA_MAX) {
+            ffs_inline_file(node, inode);
+            continue;
+        }
+
+        node->blocks = (node->st.st_size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+        node->stored = node->blocks;
+        // single block files cannot get any smaller
+        if ((layout->feature_incompat & FFS_FEATURE_INCOMPAT_COMPRESSION) && node->blocks > 1) {
+            node->compressed = 1;
+            compress = 1;
+            ffs_find_holes(node);
+        } else if (layout->sparse && node->blocks > 0) {
+            ffs_find_holes(node);
+        }
+    }
+
+    // compressed sizes are needed before anything can be placed, files are compressed only once for that
+    FILE **spills = NULL;
+    if (compress) {
+        if ((spills = calloc(threads, sizeof(FILE *))) == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (uint64_t i = 0; i < threads; ++i) {
+            if ((spills[i] = tmpfile()) == NULL) {
+                perror("tmpfile");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ffs_copy_files(fd, layout, &tree, threads, 1, spills);
+    }
+
+    // lay out files one after another
+    for (uint64_t i = 1; i < tree.count; ++i) {
+        ffs_node_t *node = &tree.nodes[i];
+        if (!S_ISREG(node->st.st_mode)) {
+            continue;
+        }
+
+        ffs_inode_t *inode = ffs_layout_inode(layout, node->inodei);
+        if (inode->i_flags & FFS_INODE_INLINE_DATA) {
+            continue;
+        }
+        if (node->clusters != NULL) {
+            node->stored = 0;
+            for (uint64_t j = 0; j < (node->blocks + FFS_CLUSTER_BLOCKS - 1) / FFS_CLUSTER_BLOCKS; ++j) {
+                node->stored += node->clusters[j];
+            }
+            if (node->compressed) {
+                inode->i_flags |= FFS_INODE_COMPRESSED;
+            }
+        }
+
+        // holes and missing indirect trees are unreadable for ffs without sparse support
+        node->meta = ffs_map_meta_blocks(layout, node->blocks, node->clusters);
+        if ((node->clusters != NULL && !node->compressed) || node->meta < ffs_meta_blocks(node->blocks)) {
+            layout->feature_incompat |= FFS_FEATURE_INCOMPAT_SPARSE;
+        }
+
+        node->first = ffs_alloc_blocks(layout, node->meta + node->stored);
+        ffs_fill_inode(inode, node, node->st.st_size);
+        ffs_map_blocks(layout, node->first, node->blocks, inode->i_block, NULL, node->clusters);
+    }
+
+    ffs_copy_files(fd, layout, &tree, threads, 0, NULL);
+
+    for (uint64_t i = 0; spills != NULL && i < threads; ++i) {
+        fclose(spills[i]);
+    }
+    free(spills);
+    ffs_free_tree(&tree);
+}
@@ -0,0 +1,296 @@
+#include "ffs_common.h"
+#include "libffs.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// counts blocks that went to free ways, warm-up stops once the whole cache is filled or it was asked to stop
+static uint8_t warmup_account(ffs_fs_t *fs, uint64_t added) {
+    pthread_mutex_lock(&fs->meta_cache_lock);
+    uint8_t full = fs->meta_cache_filled == FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS;
+    pthread_mutex_unlock(&fs->meta_cache_lock);
+
+    pthread_mutex_lock(&fs->warmup_lock);
+    fs->warmup_blocks += added;
+    uint8_t go = !full && !fs->warmup_stop && fs->warmup_blocks < FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS;
+    pthread_mutex_unlock(&fs->warmup_lock);
+    return go;
+}
+
+static int warmup_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// loads sorted block numbers merging contiguous ones into single reads
+static uint8_t warmup_blocks(ffs_fs_t *fs, uint64_t *blocknos, uint64_t count, uint8_t kind, uint8_t load) {
+    for (uint64_t i = 0; i < count;) {
+        uint64_t run = 1;
+        while (i + run < count && run < FFS_WARMUP_RUN && blocknos[i + run] == blocknos[i] + run) {
+            run++;
+        }
+        if (!warmup_account(fs, meta_preload(fs, blocknos[i], run, kind, blocknos[i], load))) {
+            return 0;
+        }
+        i += run;
+    }
+    return 1;
+}
+
+// loads directory blocks of every directory among the inodes, their inodes are cached by now
+static uint8_t warmup_dirs(ffs_fs_t *fs, uint64_t *inodes, uint64_t count, uint8_t load) {
+    uint64_t *blocknos = NULL, n = 0, capacity = 0;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        ffs_inode_t inode;
+        if (prefetch_inode(fs, inodes[i], &inode, load) == EXIT_FAILURE || !S_ISDIR(inode.i_mode) ||
+            (inode.i_flags & FFS_INODE_INLINE_DATA)) {
+            continue;
+        }
+
+        uint64_t blocks = inode.i_size / sizeof(ffs_block_t);
+        for (uint64_t block = 0; block < blocks; ++block) {
+            if (n == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                uint64_t *grown;
+                if ((grown = realloc(blocknos, capacity * sizeof(uint64_t))) == NULL) {
+                    free(blocknos);
+                    return 0;
+                }
+                blocknos = grown;
+            }
+            if ((blocknos[n] = ffs_bmap(fs, &inode, block)) != 0) {
+                n++;
+            }
+        }
+    }
+
+    // directory blocks are allocated next to each other, sorting turns them into a few long reads
+    qsort(blocknos, n, sizeof(uint64_t), warmup_compare);
+    uint8_t go = warmup_blocks(fs, blocknos, n, FFS_META_DIRECTORY, load);
+    free(blocknos);
+    return go;
+}
+
+// inodes of one chunk of the sorted hot list, their table blocks first and then directories among them
+static void warmup_hot(ffs_fs_t *fs, uint64_t *inodes, uint64_t count) {
+    uint64_t per_block = sizeof(ffs_block_t) / sizeof(ffs_inode_t);
+
+    uint32_t start = 0;
+    uint64_t run = 0, first = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t blockno;
+        size_t offset;
+        if (inode_location(fs, inodes[i], &blockno, &offset) == EXIT_FAILURE) {
+            continue;
+        }
+        uint64_t base = inodes[i] - offset / sizeof(ffs_inode_t);
+
+        // neighbours share the block, next block of the same table extends the run
+        if (run > 0 && blockno == start + run - 1) {
+            continue;
+        }
+        if (run > 0 && run < FFS_WARMUP_RUN && blockno == start + run && base == first + run * per_block) {
+            run++;
+            continue;
+        }
+        if (run > 0 && !warmup_account(fs, meta_preload(fs, start, run, FFS_META_INODES, first, FFS_META_HOT))) {
+            return;
+        }
+        start = blockno;
+        first = base;
+        run = 1;
+    }
+    if (run > 0 && !warmup_account(fs, meta_preload(fs, start, run, FFS_META_INODES, first, FFS_META_HOT))) {
+        return;
+    }
+
+    warmup_dirs(fs, inodes, count, FFS_META_HOT);
+}
+
+// used part of a group's inode table, then blocks of its directories
+static void warmup_group(ffs_fs_t *fs, uint64_t gbn) {
+    ffs_bgd_t bgd;
+    if (read_bgd(fs, gbn, &bgd) == EXIT_FAILURE || bgd.bgd_free_inodes_count >= fs->sb.sb_inodes_per_group ||
+        bgd.bgd_inode_bitmap == 0 || bgd.bgd_inode_bitmap >= fs->sb.sb_blocks_count) {
+        return;
+    }
+
+    ffs_block_t bitmap;
+    if (preadbuff(fs->fd, &bitmap, sizeof(bitmap), (off_t) bgd.bgd_inode_bitmap * sizeof(ffs_block_t)) !=
+        sizeof(bitmap)) {
+        return;
+    }
+
+    // inodes are allocated from the start of the table, nothing past the last used one is read
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < fs->sb.sb_inodes_per_group; ++i) {
+        if (bitmap_get_bit(bitmap.b_data, i)) {
+            used = i + 1;
+        }
+    }
+    uint64_t per_block = sizeof(ffs_block_t) / sizeof(ffs_inode_t);
+    uint64_t blocks = (used + per_block - 1) / per_block;
+    uint64_t first = gbn * fs->sb.sb_inodes_per_group + 1;
+
+    for (uint64_t block = 0; block < blocks; block += FFS_WARMUP_RUN) {
+        uint64_t run = blocks - block < FFS_WARMUP_RUN ? blocks - block : FFS_WARMUP_RUN;
+        if (!warmup_account(fs, meta_preload(fs, bgd.bgd_inode_table + block, run, FFS_META_INODES,
+                                             first + block * per_block, FFS_META_SCAN))) {
+            return;
+        }
+    }
+
+    if (bgd.bgd_used_dirs_count == 0) {
+        return;
+    }
+    uint64_t *inodes;
+    if ((inodes = malloc(used * sizeof(uint64_t))) == NULL) {
+        return;
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < used; ++i) {
+        if (bitmap_get_bit(bitmap.b_data, i)) {
+            inodes[count++] = first + i;
+        }
+    }
+    warmup_dirs(fs, inodes, count, FFS_META_SCAN);
+    free(inodes);
+}
+
+static void *warmup_worker(void *arg) {
+    ffs_fs_t *fs = arg;
+    uint64_t hot_tasks = (fs->warmup_hot_count + FFS_WARMUP_HOT_CHUNK - 1) / FFS_WARMUP_HOT_CHUNK;
+
+    for (;;) {
+        pthread_mutex_lock(&fs->warmup_lock);
+        uint64_t task = fs->warmup_next++;
+        uint8_t go = !fs->warmup_stop && task < fs->warmup_tasks &&
+                     fs->warmup_blocks < FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS;
+        pthread_mutex_unlock(&fs->warmup_lock);
+        if (!go) {
+            break;
+        }
+
+        if (task < hot_tasks) {
+            uint64_t start = task * FFS_WARMUP_HOT_CHUNK;
+            uint64_t count = fs->warmup_hot_count - start < FFS_WARMUP_HOT_CHUNK ? fs->warmup_hot_count - start
+                                                                                 : FFS_WARMUP_HOT_CHUNK;
+            warmup_hot(fs, fs->warmup_hot + start, count);
+        } else {
+            warmup_group(fs, task - hot_tasks);
+        }
+
+        pthread_mutex_lock(&fs->warmup_lock);
+        fs->warmup_done++;
+        pthread_mutex_unlock(&fs->warmup_lock);
+    }
+
+    return NULL;
+}
+
+int ffs_fs_warmup_start(ffs_fs_t *fs, uint64_t threads, const uint64_t *hot, uint64_t count) {
+    if (fs->warmup_threads != NULL || threads == 0) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    // hot inodes are read in inode order, so neighbours share table blocks and reads
+    if (count > 0) {
+        if ((fs->warmup_hot = malloc(count * sizeof(uint64_t))) == NULL) {
+            return EXIT_FAILURE;
+        }
+        memcpy(fs->warmup_hot, hot, count * sizeof(uint64_t));
+        qsort(fs->warmup_hot, count, sizeof(uint64_t), warmup_compare);
+    }
+    fs->warmup_hot_count = count;
+
+    if ((fs->warmup_threads = calloc(threads, sizeof(pthread_t))) == NULL) {
+        free(fs->warmup_hot);
+        fs->warmup_hot = NULL;
+        return EXIT_FAILURE;
+    }
+    fs->warmup_tasks = (count + FFS_WARMUP_HOT_CHUNK - 1) / FFS_WARMUP_HOT_CHUNK +
+                       fs->sb.sb_blocks_count / fs->sb.sb_blocks_per_group;
+    fs->warmup_next = 0;
+    fs->warmup_done = 0;
+    fs->warmup_blocks = 0;
+    fs->warmup_stop = 0;
+
+    for (fs->warmup_thread_count = 0; fs->warmup_thread_count < threads; ++fs->warmup_thread_count) {
+        int error;
+        if ((error = pthread_create(&fs->warmup_threads[fs->warmup_thread_count], NULL, warmup_worker, fs)) != 0) {
+            // threads started so far do the whole job
+            if (fs->warmup_thread_count == 0) {
+                free(fs->warmup_threads);
+                free(fs->warmup_hot);
+                fs->warmup_threads = NULL;
+                fs->warmup_hot = NULL;
+                errno = error;
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void ffs_fs_warmup_stop(ffs_fs_t *fs) {
+    if (fs->warmup_threads == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&fs->warmup_lock);
+    fs->warmup_stop = 1;
+    pthread_mutex_unlock(&fs->warmup_lock);
+
+    for (uint64_t i = 0; i < fs->warmup_thread_count; ++i) {
+        pthread_join(fs->warmup_threads[i], NULL);
+    }
+
+    free(fs->warmup_threads);
+    free(fs->warmup_hot);
+    fs->warmup_threads = NULL;
+    fs->warmup_hot = NULL;
+    fs->warmup_thread_count = 0;
+}
+
+static int hot_compare(const void *a, const void *b) {
+    const struct ffs_meta_cache_entry *x = *(struct ffs_meta_cache_entry *const *) a;
+    const struct ffs_meta_cache_entry *y = *(struct ffs_meta_cache_entry *const *) b;
+    return x->used > y->used ? -1 : x->used < y->used;
+}
+
+uint64_t ffs_fs_hot_inodes(ffs_fs_t *fs, uint64_t *inodes, uint64_t max) {
+    struct ffs_meta_cache_entry *entries[FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS];
+    uint64_t n = 0, count = 0;
+
+    pthread_mutex_lock(&fs->meta_cache_lock);
+    for (size_t set = 0; set < FFS_META_CACHE_SETS; ++set) {
+        for (size_t way = 0; way < FFS_META_CACHE_WAYS; ++way) {
+            struct ffs_meta_cache_entry *entry = &fs->meta_cache[set][way];
+            // blocks only the warm-up loaded say nothing about what is hot
+            if (entry->valid && entry->kind == FFS_META_INODES && entry->used != 0) {
+                entries[n++] = entry;
+            }
+        }
+    }
+    qsort(entries, n, sizeof(struct ffs_meta_cache_entry *), hot_compare);
+
+    // only inodes in use and intact are worth loading next time
+    for (uint64_t i = 0; i < n && count < max; ++i) {
+        ffs_inode_t *table = (ffs_inode_t *) entries[i]->block.b_data;
+        for (uint64_t j = 0; j < sizeof(ffs_block_t) / sizeof(ffs_inode_t) && count < max; ++j) {
+            if (table[j].i_mode != 0 && !(entries[i]->bad & (uint64_t) 1 << j)) {
+                inodes[count++] = entries[i]->base + j;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->meta_cache_lock);
+
+    return count;
+}
@@ -0,0 +1,514 @@
+#include "ffs_common.h"
+#include "ffs_csum.h"
+#include "libffs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int ffs_fs_compare_blocks(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+ffs_fs_t *ffs_fs_open(const char *image, int flags) {
+    int fd;
+    if ((fd = open(image, flags)) == -1) {
+        return NULL;
+    }
+
+    ffs_fs_t *fs;
+    if ((fs = ffs_fs_open_fd(fd, flags)) == NULL) {
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+    return fs;
+}
+
+ffs_fs_t *ffs_fs_open_fd(int fd, int flags) {
+    ffs_sb_t sb;
+    if (preadbuff(fd, &sb, sizeof(ffs_sb_t), 1024) != sizeof(ffs_sb_t)) {
+        errno = errno == 0 ? EINVAL : errno;
+        return NULL;
+    }
+
+    // superblock is verified once here, everything else when it is first loaded
+    if (sb.sb_magic != FFS_MAGIC || sb.sb_log_block_size != FFS_LOG_BLOCK_SIZE ||
+        sb.sb_blocks_per_group != FFS_BLOCKS_PER_GROUP || sb.sb_inodes_per_group != FFS_INODES_PER_GROUP) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (sb.sb_feature_incompat & ~FFS_FEATURE_INCOMPAT_SUPPORTED) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY && (sb.sb_feature_ro_compat & ~FFS_FEATURE_RO_COMPAT_SUPPORTED)) {
+        errno = EROFS;
+        return NULL;
+    }
+    if ((sb.sb_feature_ro_compat & FFS_FEATURE_RO_COMPAT_METADATA_CSUM) && sb.sb_checksum != ffs_sb_checksum(&sb)) {
+        errno = EBADMSG;
+        return NULL;
+    }
+
+    // caches are large, so the handle lives on the heap
+    ffs_fs_t *fs;
+    if ((fs = calloc(1, sizeof(ffs_fs_t))) == NULL) {
+        return NULL;
+    }
+    fs->fd = fd;
+    fs->sb = sb;
+    pthread_mutex_init(&fs->meta_cache_lock, NULL);
+    pthread_mutex_init(&fs->cluster_cache_lock, NULL);
+    pthread_mutex_init(&fs->warmup_lock, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+
+    return fs;
+}
+
+void ffs_fs_close(ffs_fs_t *fs) {
+    if (fs == NULL) {
+        return;
+    }
+    ffs_fs_warmup_stop(fs);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->warmup_lock);
+    pthread_mutex_destroy(&fs->cluster_cache_lock);
+    pthread_mutex_destroy(&fs->meta_cache_lock);
+    close(fs->fd);
+    free(fs);
+}
+
+int ffs_fs_statfs(ffs_fs_t *fs, struct statvfs *st) {
+    // free counts change while holes are punched, they are read as one snapshot
+    pthread_mutex_lock(&fs->alloc_lock);
+    ffs_sb_t sb = fs->sb;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = 1024 << sb.sb_log_block_size;
+    st->f_frsize = st->f_bsize;
+    st->f_blocks = sb.sb_blocks_count;
+    st->f_bfree = sb.sb_free_blocks_count;
+    st->f_bavail = sb.sb_free_blocks_count;
+    st->f_files = sb.sb_inodes_count;
+    st->f_ffree = sb.sb_free_inodes_count;
+    st->f_namemax = FFS_FILENAME_MAX_LENGTH;
+    return EXIT_SUCCESS;
+}
+
+int ffs_fs_lookup(ffs_fs_t *fs, const char *path, uint64_t *inodei) {
+    if (path[0] != '/') {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    int64_t inum;
+    if ((inum = path_to_inode(fs, path)) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    *inodei = inum;
+    return EXIT_SUCCESS;
+}
+
+int ffs_fs_lookup_at(ffs_fs_t *fs, uint64_t dir, const char *name, uint64_t *inodei) {
+    ffs_inode_t inode;
+    if (read_inode(fs, dir, &inode) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    int64_t inum;
+    if ((inum = entry_inode_no(fs, &inode, name)) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    *inodei = inum;
+    return EXIT_SUCCESS;
+}
+
+int ffs_fs_stat(ffs_fs_t *fs, uint64_t inodei, struct stat *st) {
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = inode.i_mode;
+    st->st_ino = inodei;
+    st->st_nlink = inode.i_links_count;
+    st->st_uid = inode.i_uid | (uid_t) inode.i_uid_high << 16;
+    st->st_gid = inode.i_gid | (gid_t) inode.i_gid_high << 16;
+    st->st_size = ffs_inode_size(&inode);
+    st->st_blksize = FFS_BLOCKSIZE;
+    st->st_blocks = inode.i_blocks;
+    st->st_atime = inode.i_atime;
+    st->st_mtime = inode.i_mtime;
+    st->st_ctime = inode.i_ctime;
+    return EXIT_SUCCESS;
+}
+
+int64_t ffs_fs_read(ffs_fs_t *fs, uint64_t inodei, void *buf, size_t size, uint64_t offset) {
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        return -1;
+    }
+    if (S_ISDIR(inode.i_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+    return read_inode_data(fs, &inode, buf, size, offset);
+}
+
+int64_t ffs_fs_lseek(ffs_fs_t *fs, uint64_t inodei, uint64_t offset, int whence) {
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        return -1;
+    }
+    uint64_t size = ffs_inode_size(&inode);
+    if (offset >= size) {
+        errno = ENXIO;
+        return -1;
+    }
+    if (inode.i_flags & FFS_INODE_INLINE_DATA) {
+        return whence == SEEK_DATA ? (int64_t) offset : (int64_t) size;
+    }
+
+    // a compressed cluster is a hole only when none of it is stored, its stored blocks come first
+    uint64_t unit = inode.i_flags & FFS_INODE_COMPRESSED ? FFS_CLUSTER_BLOCKS : 1;
+    uint64_t block = offset / FFS_BLOCKSIZE / unit * unit;
+    uint64_t blocks = (size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+
+    while (block < blocks) {
+        uint32_t blockno;
+        uint64_t extent;
+        if (ffs_bmap_extent(fs, &inode, block, &blockno, &extent) == EXIT_FAILURE) {
+            return -1;
+        }
+        if ((blockno != 0) == (whence == SEEK_DATA)) {
+            uint64_t found = block * FFS_BLOCKSIZE;
+            return found > offset ? (int64_t) found : (int64_t) offset;
+        }
+
+        // whole missing trees are skipped at once
+        if (blockno == 0 && extent > unit) {
+            block += extent - extent % unit;
+        } else {
+            block += unit;
+        }
+    }
+
+    if (whence == SEEK_DATA) {
+        errno = ENXIO;
+        return -1;
+    }
+    return size;
+}
+
+int ffs_fs_punch_hole(ffs_fs_t *fs, uint64_t inodei, uint64_t offset, uint64_t length) {
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return EXIT_FAILURE;
+    }
+    if (!S_ISREG(inode.i_mode)) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        errno = S_ISDIR(inode.i_mode) ? EISDIR : ENODEV;
+        return EXIT_FAILURE;
+    }
+    // inline contents have no blocks and compressed clusters cannot be split
+    if (inode.i_flags & (FFS_INODE_INLINE_DATA | FFS_INODE_COMPRESSED)) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        errno = EOPNOTSUPP;
+        return EXIT_FAILURE;
+    }
+
+    uint64_t size = ffs_inode_size(&inode);
+    uint64_t end = length > size || offset > size - length ? size : offset + length;
+    if (offset >= end) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return EXIT_SUCCESS;
+    }
+
+    // blocks fully inside the range are freed, the last one also when the range reaches end of file
+    uint64_t first = (offset + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE;
+    uint64_t last = end == size ? (size + FFS_BLOCKSIZE - 1) / FFS_BLOCKSIZE : end / FFS_BLOCKSIZE;
+
+    // partial blocks at the edges keep their place and get zeroed
+    static const uint8_t zeros[FFS_BLOCKSIZE];
+    uint64_t edges[2][2] = {
+            {offset, first * FFS_BLOCKSIZE < end ? first * FFS_BLOCKSIZE : end},
+            {last * FFS_BLOCKSIZE > offset ? last * FFS_BLOCKSIZE : offset, end}
+    };
+    for (uint8_t i = 0; i < 2; ++i) {
+        if (edges[i][0] >= edges[i][1] || (i == 1 && edges[1][0] < edges[0][1])) {
+            continue;
+        }
+        // holes have nothing to zero, but a failed lookup must not be taken for one
+        uint32_t blockno;
+        uint64_t extent;
+        if (ffs_bmap_extent(fs, &inode, edges[i][0] / FFS_BLOCKSIZE, &blockno, &extent) == EXIT_FAILURE ||
+            (blockno != 0 && pwritebuff(fs->fd, (void *) zeros, edges[i][1] - edges[i][0],
+                                        (off_t) blockno * FFS_BLOCKSIZE + edges[i][0] % FFS_BLOCKSIZE) == -1)) {
+            pthread_mutex_unlock(&fs->alloc_lock);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t *freed = NULL;
+    uint64_t count = 0, capacity = 0;
+    uint8_t status = EXIT_SUCCESS;
+    for (uint64_t block = first; block < last && status == EXIT_SUCCESS;) {
+        uint32_t blockno;
+        uint64_t extent;
+        if ((status = ffs_bmap_extent(fs, &inode, block, &blockno, &extent)) == EXIT_FAILURE) {
+            break;
+        }
+        // nothing to free in holes, missing trees are passed in one step
+        if (blockno == 0) {
+            block += extent < last - block ? extent : last - block;
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 256 : capacity * 2;
+            uint32_t *grown;
+            if ((grown = realloc(freed, capacity * sizeof(uint32_t))) == NULL) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            freed = grown;
+        }
+        // the flag goes to disk before the first pointer is cleared, so no crash leaves holes without it
+        if (count == 0 && (status = ffs_set_feature_incompat(fs, FFS_FEATURE_INCOMPAT_SPARSE)) == EXIT_FAILURE) {
+            break;
+        }
+        // indirect blocks that end up empty stay allocated, they are reused if the range is written again
+        if ((status = ffs_unmap_block(fs, &inode, block, &freed[count])) == EXIT_SUCCESS && freed[count] != 0) {
+            count++;
+        }
+        block++;
+    }
+
+    // block map changes made so far are kept even after a failure, so the freed blocks are returned too
+    inode.i_blocks -= count * (FFS_BLOCKSIZE / 512);
+    if (write_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        status = EXIT_FAILURE;
+    }
+    qsort(freed, count, sizeof(uint32_t), ffs_fs_compare_blocks);
+    if (count > 0 && ffs_free_blocks(fs, freed, count) == EXIT_FAILURE) {
+        status = EXIT_FAILURE;
+    }
+
+    free(freed);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return status;
+}
+
+int ffs_fs_readlink(ffs_fs_t *fs, uint64_t inodei, char *buf, size_t size) {
+    // there must be room for the terminating null
+    if (size == 0) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    if (!S_ISLNK(inode.i_mode)) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    // short targets are stored inline, so this usually costs no extra read
+    int64_t len = read_inode_data(fs, &inode, buf, size - 1, 0);
+    if (len < 0) {
+        return EXIT_FAILURE;
+    }
+    buf[len] = '\0';
+    return EXIT_SUCCESS;
+}
+
+int ffs_fs_readdir(ffs_fs_t *fs, uint64_t dir, uint64_t cookie, ffs_fs_dirent_t fill, void *arg) {
+    ffs_inode_t inode;
+    if (read_inode(fs, dir, &inode) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    if (!S_ISDIR(inode.i_mode)) {
+        errno = ENOTDIR;
+        return EXIT_FAILURE;
+    }
+
+    // number of blocks used by inode
+    uint64_t blocks = inode.i_size / sizeof(ffs_block_t);
+
+    // cookie is logical block and record position following the last returned entry
+    uint64_t block = cookie / sizeof(ffs_block_t);
+    size_t start = cookie % sizeof(ffs_block_t);
+
+    for (; block < blocks; ++block, start = 0) {
+        ffs_block_t data;
+        if (read_dir_block(fs, ffs_bmap(fs, &inode, block), &data) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+
+        ffs_de_t *de;
+        for (size_t pos = 0; (de = dir_entry_at(&data, pos)) != NULL; pos += de->de_rec_len) {
+            // skip unused records and ones returned before
+            if (de->de_inode == 0 || pos < start) {
+                continue;
+            }
+
+            // copy entry name
+            char name[248];
+            memcpy(name, de->de_name, de->de_name_len);
+            name[de->de_name_len] = '\0';
+
+            if (fill(arg, name, de->de_inode, block * sizeof(ffs_block_t) + pos + de->de_rec_len) != 0) {
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+struct ffs_fs_walk {
+    ffs_fs_t *fs;
+    ffs_fs_visit_t visit;
+    void *arg;
+    char path[PATH_MAX];
+    size_t len;
+    int stopped;
+    int failed;
+};
+
+static int ffs_fs_walk_entry(void *arg, const char *name, uint64_t inodei, uint64_t cookie) {
+    struct ffs_fs_walk *walk = arg;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+
+    // extend path with the entry name, restored before returning
+    size_t len = walk->len, name_len = strlen(name);
+    if (len + (len > 0) + name_len >= sizeof(walk->path)) {
+        errno = ENAMETOOLONG;
+        walk->failed = 1;
+        return 1;
+    }
+    if (len > 0) {
+        walk->path[walk->len++] = '/';
+    }
+    memcpy(walk->path + walk->len, name, name_len + 1);
+    walk->len += name_len;
+
+    struct stat st;
+    if (ffs_fs_stat(walk->fs, inodei, &st) == EXIT_FAILURE) {
+        walk->failed = 1;
+    } else if (walk->visit(walk->arg, walk->path, inodei, &st) != 0) {
+        walk->stopped = 1;
+    } else if (S_ISDIR(st.st_mode) && ffs_fs_readdir(walk->fs, inodei, 0, ffs_fs_walk_entry, walk) == EXIT_FAILURE) {
+        walk->failed = 1;
+    }
+
+    walk->len = len;
+    walk->path[len] = '\0';
+    return walk->stopped || walk->failed;
+}
+
+int ffs_fs_iterate(ffs_fs_t *fs, uint64_t dir, ffs_fs_visit_t visit, void *arg) {
+    struct ffs_fs_walk *walk;
+    if ((walk = calloc(1, sizeof(struct ffs_fs_walk))) == NULL) {
+        return EXIT_FAILURE;
+    }
+    walk->fs = fs;
+    walk->visit = visit;
+    walk->arg = arg;
+
+    int status = ffs_fs_readdir(fs, dir, 0, ffs_fs_walk_entry, walk);
+    if (walk->failed) {
+        status = EXIT_FAILURE;
+    }
+
+    free(walk);
+    return status;
+}
+
+uint32_t ffs_fs_bmap(ffs_fs_t *fs, uint64_t inodei, uint64_t block) {
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        return 0;
+    }
+    return ffs_bmap(fs, &inode, block);
+}
+
+int ffs_fs_chmod(ffs_fs_t *fs, uint64_t inodei, mode_t mode) {
+    // the whole inode is written back, a concurrent punch must not have its block map undone
+    pthread_mutex_lock(&fs->alloc_lock);
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return EXIT_FAILURE;
+    }
+    inode.i_mode = (inode.i_mode & S_IFMT) | (mode & ~S_IFMT);
+    uint8_t status = write_inode(fs, inodei, &inode);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return status;
+}
+
+int ffs_fs_chown(ffs_fs_t *fs, uint64_t inodei, uid_t uid, gid_t gid) {
+    pthread_mutex_lock(&fs->alloc_lock);
+    ffs_inode_t inode;
+    if (read_inode(fs, inodei, &inode) == EXIT_FAILURE) {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return EXIT_FAILURE;
+    }
+
+    // -1 leaves the id as it is
+    if (uid != (uid_t) -1) {
+        inode.i_uid = uid & 0xffff;
+        inode.i_uid_high = uid >> 16;
+    }
+    if (gid != (gid_t) -1) {
+        inode.i_gid = gid & 0xffff;
+        inode.i_gid_high = gid >> 16;
+    }
+    uint8_t status = write_inode(fs, inodei, &inode);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return status;
+}
+
+int ffs_fs_stats(ffs_fs_t *fs, ffs_fs_stats_t *stats) {
+    memset(stats, 0, sizeof(ffs_fs_stats_t));
+
+    pthread_mutex_lock(&fs->meta_cache_lock);
+    stats->meta_hits = fs->meta_cache_hits;
+    stats->meta_misses = fs->meta_cache_misses;
+    pthread_mutex_unlock(&fs->meta_cache_lock);
+
+    pthread_mutex_lock(&fs->cluster_cache_lock);
+    stats->cluster_hits = fs->cluster_cache_hits;
+    stats->cluster_misses = fs->cluster_cache_misses;
+    pthread_mutex_unlock(&fs->cluster_cache_lock);
+
+    // warm-up is over once every task is done or it ran out of cache
+    pthread_mutex_lock(&fs->warmup_lock);
+    stats->warmup_tasks = fs->warmup_tasks;
+    stats->warmup_tasks_done = fs->warmup_done;
+    stats->warmup_blocks = fs->warmup_blocks;
+    stats->warmup_running = fs->warmup_threads != NULL && !fs->warmup_stop && fs->warmup_done < fs->warmup_tasks &&
+                            fs->warmup_blocks < FFS_META_CACHE_SETS * FFS_META_CACHE_WAYS;
+    pthread_mutex_unlock(&fs->warmup_lock);
+
+    return EXIT_SUCCESS;
+}